@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -27,7 +28,7 @@ const result_type cat_mask   = 0x7FFFFFFF;
 enum wiConn { WC_XHR, WC_SOCKET, WC_JS, WC_JS_CONT };
 
 // work item type
-enum wiType { WT_INTERSECT, WT_TRAVERSE, WT_NOTIN, WT_PATH, WT_FQV };
+enum wiType { WT_INTERSECT, WT_TRAVERSE, WT_NOTIN, WT_PATH, WT_FQV, WT_PARENTS, WT_EXPR, WT_EXPORT };
 
 // work item status type
 enum wiStatus { WS_WAITING, WS_PREPROCESS, WS_COMPUTING, WS_STREAMING, WS_DONE };
@@ -75,7 +76,18 @@ inline result_type rbPop(ringBuffer &rb) {
 }
 
 
+// boolean query expression node (op is 0 for a category operand, or one of '&', '|', '-')
+struct exprNode {
+  char op;
+  int cid, depth; // operand
+  int a, b;       // child node indices
+};
+const int maxExprNodes = 63;
+
+
 // work item queue
+struct workerContext;
+struct database;
 struct workItem {
   // thread data
   pthread_mutex_t mutex;
@@ -89,11 +101,19 @@ struct workItem {
   int c1, c2; // categories
   int d1, d2; // depths
 
-  // offset and size
+  // offset and size (and exact count flag)
   int o,s;
+  bool exact;
+
+  // cursor (cache serial of the c1 result, scan position, and matches so far)
+  bool cursor;
+  unsigned int cserial;
+  int ci, cn;
 
   // conenction type
   wiConn connection;
+  bool binary; // compact binary results (t=bin)
+  bool sorted; // export sorted by page id (sort=1)
 
   // job type
   wiType type;
@@ -101,44 +121,470 @@ struct workItem {
   // status
   wiStatus status;
   int t0; // queuing timestamp
+
+  // query expression (nodes and index of the root node)
+  exprNode expr[maxExprNodes];
+  int nexpr, exprRoot;
+
+  // compute worker processing this item
+  workerContext *ctx;
+
+  // database snapshot the item was validated against (held until it is computed)
+  database *db;
+  unsigned int generation; // of db when the computation started
+};
+
+//
+// database files. Every file starts with a header followed by count entries of width
+// bytes: fastcci.cat and fastcci.rcat hold 64 bit offsets into fastcci.tree and
+// fastcci.rtree, which hold 32 bit page ids. Files without a header use the old layout
+// (32 bit offsets, absolute block bounds in the tree) and are converted when loaded.
+// Databases with dense ids number the pages consecutively (categories first, then
+// files) instead of using their page ids, fastcci.ids holds the page id of every dense
+// id and fastcci.idorder the dense ids sorted by page id. fastcci.scat and fastcci.stree
+// hold the subcategories of every category without the file lists.
+//
+
+typedef int64_t offset_type;
+
+const uint32_t dbMagic = 0x49434346; // "FCCI"
+const uint32_t dbVersion = 3;
+enum dbKind { DB_CAT = 1, DB_TREE, DB_RCAT, DB_RTREE, DB_IDS, DB_IDORDER, DB_SCAT, DB_STREE };
+
+// tree flags
+const uint32_t dbPacked = 1; // file lists are packed (see fastcci_pack.h)
+
+// category index flags
+const uint32_t dbDense = 2; // pages are numbered by dense ids
+
+struct dbHeader {
+  uint32_t magic, version, kind, flags;
+  uint64_t count;    // number of entries
+  uint64_t checksum; // of the entries (see dbChecksum)
+  uint32_t width;    // bytes per entry
+  uint32_t reserved[7];
+};
+
+inline uint32_t dbWidth(uint32_t kind) {
+  return (kind == DB_CAT || kind == DB_RCAT || kind == DB_SCAT) ? sizeof(offset_type) : sizeof(tree_type);
+}
+
+// FNV-1a over 32 bit words, continue a running checksum by passing it as h
+uint64_t dbChecksum(const void *data, size_t bytes, uint64_t h = 14695981039346656037ULL) {
+  const uint32_t *w = (const uint32_t*)data;
+  for (size_t i=0; i<bytes/4; ++i) h = (h ^ w[i]) * 1099511628211ULL;
+  return h;
+}
+
+// verify the checksums of the entries when loading (a full pass over every file, the
+// header and the file size are always checked)
+bool dbVerify = false;
+
+void dbFillHeader(dbHeader &h, uint32_t kind, uint32_t flags, uint64_t count, uint64_t checksum) {
+  memset(&h, 0, sizeof h);
+  h.magic = dbMagic;
+  h.version = dbVersion;
+  h.kind = kind;
+  h.flags = flags;
+  h.count = count;
+  h.checksum = checksum;
+  h.width = dbWidth(kind);
+}
+
+// (re)write the header at the start of f
+bool dbWriteHeader(FILE *f, uint32_t kind, uint32_t flags, uint64_t count, uint64_t checksum) {
+  dbHeader h;
+  dbFillHeader(h, kind, flags, count, checksum);
+  long pos = ftell(f);
+  return fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof h, 1, f) == 1 && (pos <= 0 || fseek(f, pos, SEEK_SET) == 0);
+}
+
+// write a complete database file
+bool dbWriteFile(const char *fname, uint32_t kind, uint32_t flags, const void *data, uint64_t count) {
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    perror(fname);
+    return false;
+  }
+  size_t bytes = count * dbWidth(kind);
+  bool ok = dbWriteHeader(f, kind, flags, count, dbChecksum(data, bytes)) && fwrite(data, 1, bytes, f) == bytes;
+  return (fclose(f) == 0) && ok;
+}
+
+// residency of the database files and of large per query tables (configured before the
+// database is loaded): prefault the pages when loading, lock the database in memory, and
+// back it with transparent or explicit (hugetlbfs) huge pages. Huge page backed files are
+// read into anonymous memory instead of being mapped from the page cache.
+enum hugeMode { HUGE_NONE, HUGE_THP, HUGE_EXPLICIT };
+struct dbResidency {
+  bool prefault, lock;
+  int huge;
+};
+dbResidency residency = {false, false, HUGE_NONE};
+
+const size_t hugePageSize = 2 * 1024 * 1024;
+
+// explicit huge page mappings are unmapped in whole huge pages
+inline size_t hugeRound(size_t len) {
+  return residency.huge == HUGE_EXPLICIT ? (len + hugePageSize-1) & ~(hugePageSize-1) : len;
+}
+
+// reserve an anonymous region of len bytes (len from hugeRound), NULL on failure
+char *mapAnonymous(size_t len) {
+  void *p = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  // (explicit huge pages are reserved up front, faults could not be satisfied otherwise)
+  if (residency.huge == HUGE_EXPLICIT && (p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0)) == MAP_FAILED)
+    fprintf(stderr, "No explicit huge pages available, using transparent huge pages.\n");
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+#if defined(MADV_HUGEPAGE)
+    if (p != MAP_FAILED && residency.huge != HUGE_NONE) madvise(p, len, MADV_HUGEPAGE);
+#endif
+  }
+  return p == MAP_FAILED ? NULL : (char*)p;
+}
+
+// fault in the pages of a mapped region for reading (private file pages stay shared with
+// the page cache, writing would copy them)
+void prefault(const char *p, size_t len) {
+  madvise((void*)p, len, MADV_WILLNEED);
+#if defined(MADV_POPULATE_READ)
+  if (madvise((void*)p, len, MADV_POPULATE_READ) == 0) return;
+#endif
+  volatile char sum = 0;
+  for (size_t i=0; i<len; i+=4096) sum += p[i];
+}
+
+// zeroed buffer for a large per query table (huge page backed and prefaulted as configured)
+void *tableAlloc(size_t bytes) {
+  void *p = residency.huge != HUGE_NONE ? mapAnonymous(hugeRound(bytes)) : calloc(bytes, 1);
+  if (p && residency.prefault) memset(p, 0, bytes);
+  return p;
+}
+
+void tableFree(void *p, size_t bytes) {
+  if (p == NULL) return;
+  if (residency.huge != HUGE_NONE)
+    munmap(p, hugeRound(bytes));
+  else
+    free(p);
+}
+
+// a mapped database file. The entries are followed by unused space for capacity-count
+// entries (the mapping is private, changes are not written back to the file).
+struct dbTable {
+  char *map;
+  size_t maplen;
+  void *data;
+  size_t count, capacity;
+  uint32_t flags;
+  bool legacy;
 };
 
-int readFile(const char *fname, tree_type* &buf)
-{
+void dbRelease(dbTable &t) {
+  if (t.map) munmap(t.map, t.maplen);
+  t.map = NULL;
+  t.data = NULL;
+  t.count = t.capacity = 0;
+}
+
+// map a database file of the given kind (with headroom for live updates if reserve is
+// set, a quarter of the entries or at least headroom entries). Returns false (with a
+// message) if the file is missing, damaged, or of another kind.
+bool dbLoad(const char *fname, uint32_t kind, dbTable &t, bool reserve = false, size_t headroom = 0) {
   fprintf(stderr, "Loading %s ...\n", fname);
+  memset(&t, 0, sizeof t);
 
   struct stat sb;
-  int fd;
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    perror(fname);
+    if (fd != -1) close(fd);
+    return false;
+  }
+
+  dbHeader h;
+  size_t width = dbWidth(kind), hlen = sizeof h, n;
+  t.legacy = !(size_t(sb.st_size) >= hlen && pread(fd, &h, hlen, 0) == ssize_t(hlen) && h.magic == dbMagic);
+  if (!t.legacy) {
+    if (h.version != dbVersion || h.kind != kind || h.width != width || h.count * width + hlen != size_t(sb.st_size)) {
+      fprintf(stderr, "%s: unsupported version or wrong file type.\n", fname);
+      close(fd);
+      return false;
+    }
+    n = h.count;
+    t.flags = h.flags;
+  } else {
+    n = sb.st_size / sizeof(tree_type);
+    hlen = 0;
+  }
+
+  // reserve the whole region and map the file at its start (old 32 bit offsets are
+  // widened into the region instead, and huge page backed regions get a copy)
+  t.count = n;
+  size_t room = n/4 + (1 << 20);
+  t.capacity = n + (reserve ? (room < headroom ? headroom : room) : 0);
+  t.maplen = hugeRound(hlen + t.capacity * width);
+  t.map = mapAnonymous(t.maplen);
+  bool widen = t.legacy && width != sizeof(tree_type), copy = widen || residency.huge != HUGE_NONE;
+
+  // files that are locked and never written (no headroom, no conversion of the old layout)
+  // are mapped read-only and shared, so locking them pins the page cache instead of
+  // copying every page of a private mapping
+  bool shared = residency.lock && !reserve && !t.legacy;
+  if (t.map == NULL ||
+      (!copy && sb.st_size > 0 && mmap(t.map, sb.st_size, shared ? PROT_READ : PROT_READ|PROT_WRITE,
+                                       (shared ? MAP_SHARED : MAP_PRIVATE)|MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    perror("mmap");
+    exit(1);
+  }
+  t.data = t.map + hlen;
+
+  if (copy && sb.st_size > 0) {
+    char *old = (char*)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (old == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    madvise(old, sb.st_size, MADV_SEQUENTIAL);
+    if (widen)
+      for (size_t i=0; i<n; ++i) ((offset_type*)t.data)[i] = ((tree_type*)old)[i];
+    else
+      memcpy(t.map, old, sb.st_size);
+    munmap(old, sb.st_size);
+  } else if (residency.prefault && sb.st_size > 0)
+    prefault(t.map, sb.st_size);
+  close(fd);
+
+  if (!t.legacy && dbVerify && dbChecksum(t.data, n * width) != h.checksum) {
+    fprintf(stderr, "%s: checksum mismatch.\n", fname);
+    dbRelease(t);
+    return false;
+  }
+
+  // (locking a private file mapping copies its pages out of the page cache)
+  if (residency.lock && n > 0 && mlock(t.map, hlen + n * width) != 0)
+    perror("mlock");
+  return true;
+}
+
+// unsigned LEB128 varints (of the edge streams and the binary query results)
+inline unsigned char *putVarint(unsigned char *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+// returns NULL if the varint runs past end
+inline const unsigned char *getVarint(const unsigned char *p, const unsigned char *end, uint64_t &v) {
+  v = 0;
+  for (int s=0; p < end && s < 64; s += 7) {
+    v |= uint64_t(*p & 0x7F) << s;
+    if ((*p++ & 0x80) == 0) return p;
+  }
+  return NULL;
+}
+
+int compare (const void * a, const void * b) {
+  return ( *(tree_type*)b - *(tree_type*)a );
+}
+
+#include "fastcci_pack.h"
+
+// a category block at tree[c] holds its number of subcategories and the length of its
+// file list, followed by the subcategories (tree[c+2] to tree[subcatEnd-1]) and the file
+// list (tree[subcatEnd] to tree[fileEnd-1]). The empty dummy category is at tree[0].
+inline offset_type subcatEnd(const tree_type *tree, offset_type c) {
+  return c + 2 + tree[c];
+}
+inline offset_type fileEnd(const tree_type *tree, offset_type c) {
+  return c + 2 + tree[c] + tree[c+1];
+}
+
+// map the category index and tree of datadir (with room for live updates if reserve is
+// set, at least treeHeadroom entries in the tree). Trees of the old layout are converted
+// to relative block bounds.
+bool dbLoadGraph(const char *datadir, dbTable &cat, dbTable &tree, bool reserve = false, size_t treeHeadroom = 0) {
+  const int buflen = 1000;
+  char fname[buflen];
+
+  snprintf(fname, buflen, "%s/fastcci.cat", datadir);
+  bool ok = dbLoad(fname, DB_CAT, cat, reserve);
+  snprintf(fname, buflen, "%s/fastcci.tree", datadir);
+  if (!ok || !dbLoad(fname, DB_TREE, tree, reserve, treeHeadroom)) {
+    dbRelease(cat);
+    return false;
+  }
+  if (cat.legacy != tree.legacy) {
+    fprintf(stderr, "fastcci.cat and fastcci.tree in %s are of different versions.\n", datadir);
+    dbRelease(cat);
+    dbRelease(tree);
+    return false;
+  }
 
-  // open file
-  fd = open(fname, O_RDONLY);
-  if (fd == -1) {
-    perror("open");
+  if (tree.legacy) {
+    offset_type *c = (offset_type*)cat.data;
+    tree_type *t = (tree_type*)tree.data;
+    if (treePacked(t, tree.count)) tree.flags |= dbPacked;
+    for (size_t i=0; i<cat.count; ++i)
+      if (c[i] > 0) {
+        tree_type subend = t[c[i]], fileend = t[c[i]+1];
+        t[c[i]] = subend - c[i] - 2;
+        t[c[i]+1] = fileend - subend;
+      }
+    if (tree.count >= 2) t[0] = t[1] = 0;
+  }
+  return true;
+}
+
+// map the database in datadir for the inspection tools (exits on errors). Tools that do
+// not read file lists pass packed to accept trees with packed file lists, tools that do
+// not deal with page ids pass dense to accept databases with dense ids.
+int readGraph(const char *datadir, offset_type* &cat, tree_type* &tree, bool *packed = NULL, bool *dense = NULL) {
+  dbTable c, t;
+  if (!dbLoadGraph(datadir, c, t)) exit(1);
+  if (packed)
+    *packed = t.flags & dbPacked;
+  else if (t.flags & dbPacked) {
+    fprintf(stderr, "This tool does not support packed file lists.\n");
     exit(1);
   }
+  if (dense)
+    *dense = c.flags & dbDense;
+  else if (c.flags & dbDense) {
+    fprintf(stderr, "This tool does not support databases with dense ids.\n");
+    exit(1);
+  }
+  cat = (offset_type*)c.data;
+  tree = (tree_type*)t.data;
+  return c.count;
+}
+
+// copy the children (subcategories and files) of the category block at tree[c] to buf
+// (grown to max entries as needed) and return their number
+int blockChildren(const tree_type *tree, offset_type c, bool packed, tree_type* &buf, int &max) {
+  int nsub = tree[c], n = nsub + fileCount(tree, subcatEnd(tree, c), fileEnd(tree, c), packed);
+  if (n > max) {
+    max = n;
+    if ((buf = (tree_type*)realloc(buf, max * sizeof *buf)) == NULL) {
+      perror("blockChildren()");
+      exit(1);
+    }
+  }
+  memcpy(buf, &(tree[c+2]), nsub * sizeof *buf);
+
+  fileReader fr;
+  fileReaderInit(fr, tree, subcatEnd(tree, c), fileEnd(tree, c), packed);
+  const tree_type *ids;
+  int m;
+  while ((m = fileReaderNext(fr, ids)) > 0) {
+    memcpy(&(buf[nsub]), ids, m * sizeof *ids);
+    nsub += m;
+  }
+  return n;
+}
+
+// build the reverse (child to parent) index of the categories below ncat as a CSR, the
+// parents of page id i are stored in rtree[rcat[i]] to rtree[rcat[i+1]-1] (in ascending order)
+void buildReverseIndex(const offset_type *cat, int ncat, const tree_type *tree, bool packed, offset_type* &rcat, int &nrcat, tree_type* &rtree, size_t &nrtree) {
+  int i, j, n, max = 0;
+  tree_type *child = NULL;
+  int maxchild = ncat-1;
+  for (i=0; i<ncat; ++i) {
+    if (cat[i]<=0) continue;
+    n = blockChildren(tree, cat[i], packed, child, max);
+    for (j=0; j<n; ++j)
+      if (child[j]>maxchild) maxchild = child[j];
+  }
 
-  // determine file size
-  if (fstat(fd, &sb) == -1) {
-    perror ("fstat");
+  nrcat = maxchild+2;
+  rcat = (offset_type*)calloc(nrcat, sizeof *rcat);
+  if (rcat == NULL) {
+    perror("rcat");
     exit(1);
   }
 
-  // map file into memory
-  buf = (tree_type*)mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (buf == MAP_FAILED) {
-    perror("mmap");
+  // count parents of each page
+  for (i=0; i<ncat; ++i) {
+    if (cat[i]<=0) continue;
+    n = blockChildren(tree, cat[i], packed, child, max);
+    for (j=0; j<n; ++j) rcat[child[j]+1]++;
+  }
+  for (i=1; i<nrcat; ++i) rcat[i] += rcat[i-1];
+
+  nrtree = rcat[nrcat-1];
+  rtree = (tree_type*)malloc((nrtree+1) * sizeof *rtree);
+  offset_type *rpos = (offset_type*)malloc(nrcat * sizeof *rpos);
+  if (rtree == NULL || rpos == NULL) {
+    perror("rtree");
     exit(1);
   }
+  memcpy(rpos, rcat, nrcat * sizeof *rpos);
 
-  // close file
-  if (close(fd) == -1) {
-    perror("close");
+  // fill in parents
+  for (i=0; i<ncat; ++i) {
+    if (cat[i]<=0) continue;
+    n = blockChildren(tree, cat[i], packed, child, max);
+    for (j=0; j<n; ++j) rtree[rpos[child[j]]++] = i;
+  }
+  free(rpos);
+  free(child);
+}
+
+// build the subcategory index of the categories below ncat as a CSR, the subcategories of
+// category i are stored in stree[scat[i]] to stree[scat[i+1]-1] (in block order). It is a
+// copy of the category graph without the file lists, small enough to stay in the cache
+// for traversals that only follow subcategories. The index ends at the last category
+// (nscat-1 categories are covered, with dense ids that excludes all files).
+void buildSubcatIndex(const offset_type *cat, int ncat, const tree_type *tree, offset_type* &scat, int &nscat, tree_type* &stree, size_t &nstree) {
+  while (ncat > 0 && cat[ncat-1] < 0) ncat--;
+  nscat = ncat+1;
+  scat = (offset_type*)malloc(nscat * sizeof *scat);
+  if (scat == NULL) {
+    perror("scat");
     exit(1);
   }
+  scat[0] = 0;
+  for (int i=0; i<ncat; ++i)
+    scat[i+1] = scat[i] + (cat[i]>0 ? tree[cat[i]] : 0);
 
-  return sb.st_size;
+  nstree = scat[ncat];
+  stree = (tree_type*)malloc((nstree+1) * sizeof *stree);
+  if (stree == NULL) {
+    perror("stree");
+    exit(1);
+  }
+  for (int i=0; i<ncat; ++i)
+    if (cat[i]>0) memcpy(&(stree[scat[i]]), &(tree[cat[i]+2]), tree[cat[i]] * sizeof *stree);
 }
 
-int compare (const void * a, const void * b) {
-  return ( *(tree_type*)b - *(tree_type*)a );
+// map the subcategory index of datadir for the tools that only follow subcategories (it
+// is built from the graph read by readGraph if the database has none or an outdated one).
+// Returns the number of categories covered.
+int readSubcats(const char *datadir, const offset_type *cat, int ncat, const tree_type *tree, offset_type* &scat, tree_type* &stree) {
+  const int buflen = 1000;
+  char fname[buflen];
+  dbTable sc, st;
+
+  snprintf(fname, buflen, "%s/fastcci.scat", datadir);
+  if (access(fname, R_OK) == 0 && dbLoad(fname, DB_SCAT, sc)) {
+    snprintf(fname, buflen, "%s/fastcci.stree", datadir);
+    if (sc.count > 0 && sc.count <= size_t(ncat)+1 && dbLoad(fname, DB_STREE, st)) {
+      scat = (offset_type*)sc.data;
+      stree = (tree_type*)st.data;
+      return sc.count-1;
+    }
+    dbRelease(sc);
+  }
+
+  fprintf(stderr, "Building the subcategory index from the tree ...\n");
+  int nscat;
+  size_t nstree;
+  buildSubcatIndex(cat, ncat, tree, scat, nscat, stree, nstree);
+  return nscat-1;
 }
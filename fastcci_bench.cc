@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#if !defined(__APPLE__)
+#include <malloc.h>
+#endif
+#include <string.h>
+#include <time.h>
+
+#include "fastcci.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Time deep traversals (breadth first like the server, collecting unique files) from
+ * the ROOTS categories with the most subcategories down to DEPTH (-1 for unlimited),
+ * and count the cache and dTLB misses they cause. Used to compare database layouts
+ * (fastcci_build_db -o).
+ *
+ *   fastcci_bench [ROOTS [DEPTH]]
+ */
+
+// the graph
+offset_type *cat;
+tree_type *tree;
+bool packed;
+int maxcat;
+
+// visitation mask, traversal queue, and collected files
+unsigned char *mask;
+tree_type *queue, *files;
+int maxfiles = 1024*1024;
+
+// open a hardware event counter of the calling thread (-1 if not available)
+int openCounter(uint32_t type, uint64_t config) {
+#if defined(__linux__)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+long readCounter(int fd) {
+  long long v;
+  return (fd >= 0 && read(fd, &v, sizeof v) == sizeof v) ? v : -1;
+}
+
+// traverse from root, returns the number of unique files (and the visited categories in ncats)
+long traverse(tree_type root, int depth, long &ncats) {
+  int head = 0, tail = 0, level = 0, levelend = 1, nfiles = 0;
+  queue[tail++] = root;
+  mask[root] = 1;
+
+  fileReader fr;
+  const tree_type *ids;
+  int n;
+  while (head < tail) {
+    if (head == levelend) {
+      level++;
+      levelend = tail;
+    }
+    offset_type c = cat[queue[head++]];
+
+    // queue unvisited subcategories
+    if (depth < 0 || level < depth)
+      for (offset_type k=c+2; k<subcatEnd(tree, c); ++k)
+        if (tree[k] < maxcat && mask[tree[k]] == 0 && cat[tree[k]] >= 0) {
+          mask[tree[k]] = 1;
+          queue[tail++] = tree[k];
+        }
+
+    // collect unvisited files
+    fileReaderInit(fr, tree, subcatEnd(tree, c), fileEnd(tree, c), packed);
+    while ((n = fileReaderNext(fr, ids)) > 0) {
+      if (nfiles + n > maxfiles) {
+        while (nfiles + n > maxfiles) maxfiles *= 2;
+        if ((files = (tree_type*)realloc(files, maxfiles * sizeof *files)) == NULL) {
+          perror("files");
+          exit(1);
+        }
+      }
+      for (int j=0; j<n; ++j)
+        if (ids[j] >= maxcat || mask[ids[j]] == 0) {
+          if (ids[j] < maxcat) mask[ids[j]] = 1;
+          files[nfiles++] = ids[j];
+        }
+    }
+  }
+
+  // clear the mask
+  for (int j=0; j<tail; ++j) mask[queue[j]] = 0;
+  for (int j=0; j<nfiles; ++j)
+    if (files[j] < maxcat) mask[files[j]] = 0;
+
+  ncats += tail;
+  return nfiles;
+}
+
+// sort categories by decreasing number of subcategories
+inline tree_type subcatCount(tree_type v) {
+  return tree[cat[v]];
+}
+int compareSize(const void * a, const void * b) {
+  tree_type x = subcatCount(*(tree_type*)a), y = subcatCount(*(tree_type*)b);
+  if (x != y) return x < y ? 1 : -1;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int nroots = argc > 1 ? atoi(argv[1]) : 100;
+  int depth = argc > 2 ? atoi(argv[2]) : -1;
+
+  bool dense;
+  maxcat = readGraph("..", cat, tree, &packed, &dense);
+
+  // the roots, including all categories tied with the last one (so that every layout
+  // of a graph is measured with the same set)
+  int ncat = 0;
+  tree_type *roots = (tree_type*)malloc(maxcat * sizeof *roots);
+  mask = (unsigned char*)calloc(maxcat, 1);
+  queue = (tree_type*)malloc(maxcat * sizeof *queue);
+  files = (tree_type*)malloc(maxfiles * sizeof *files);
+  if (roots == NULL || mask == NULL || queue == NULL || files == NULL) {
+    perror("main");
+    exit(1);
+  }
+  for (int v=0; v<maxcat; ++v)
+    if (cat[v] > 0) roots[ncat++] = v;
+  qsort(roots, ncat, sizeof *roots, compareSize);
+  if (nroots > ncat) nroots = ncat;
+  while (nroots > 0 && nroots < ncat && subcatCount(roots[nroots]) == subcatCount(roots[nroots-1])) nroots++;
+
+  // warm up (fault in the mapped files), then measure
+  long ncats = 0, nfiles = 0;
+  for (int i=0; i<nroots; ++i) traverse(roots[i], depth, ncats);
+
+  int fdcache = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  int fdtlb = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  long cache0 = readCounter(fdcache), tlb0 = readCounter(fdtlb);
+  timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  ncats = 0;
+  for (int i=0; i<nroots; ++i) nfiles += traverse(roots[i], depth, ncats);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long cache = readCounter(fdcache) - cache0, tlb = readCounter(fdtlb) - tlb0;
+  double t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  printf("%d traversals (depth %d, %s%s): %ld categories, %ld files in %.3fs\n", nroots, depth,
+         packed ? "packed" : "unpacked", dense ? ", dense ids" : "", ncats, nfiles, t);
+  if (fdcache >= 0)
+    printf("cache misses: %ld (%.2f per category)\n", cache, double(cache) / ncats);
+  else
+    printf("cache misses: not available\n");
+  if (fdtlb >= 0)
+    printf("dTLB misses: %ld (%.2f per category)\n", tlb, double(tlb) / ncats);
+  else
+    printf("dTLB misses: not available\n");
+
+  return 0;
+}
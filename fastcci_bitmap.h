@@ -0,0 +1,167 @@
+// compressed bitmaps of page ids (roaring style). The id space is split into chunks of
+// 65536 ids, each non-empty chunk is a container holding either a sorted array of the
+// low 16 bits of its ids (up to bmArrayMax ids) or a bitset of 1024 words. Every id has
+// a rank (its position in ascending order), so values can be stored next to a bitmap.
+
+#include <stdint.h>
+
+const int bmArrayMax = 4096;
+const int bmWords = 1024;
+
+struct bmContainer {
+  uint16_t key;     // high 16 bits of the ids
+  int card;         // number of ids
+  int base;         // number of ids in the containers before this one
+  uint16_t *array;  // sorted low 16 bits (array container)
+  uint64_t *bits;   // bitset (bitset container)
+  uint16_t *before; // number of ids in the words before each word (bitset container)
+};
+
+struct bitmap {
+  int num, max;
+  bmContainer *c;
+};
+
+void bmInit(bitmap &b) {
+  b.num = 0;
+  b.max = 0;
+  b.c = NULL;
+}
+
+void bmFree(bitmap &b) {
+  for (int i=0; i<b.num; ++i) {
+    free(b.c[i].array);
+    free(b.c[i].bits);
+    free(b.c[i].before);
+  }
+  free(b.c);
+  bmInit(b);
+}
+
+// append a new (empty) container with a key larger than all existing keys
+bmContainer &bmAppend(bitmap &b, uint16_t key) {
+  if (b.num == b.max) {
+    b.max = b.max ? 2*b.max : 16;
+    if ((b.c = (bmContainer*)realloc(b.c, b.max * sizeof *(b.c))) == NULL) {
+      perror("bmAppend()");
+      exit(1);
+    }
+  }
+  bmContainer &c = b.c[b.num++];
+  c.key = key;
+  c.card = 0;
+  c.base = b.num > 1 ? b.c[b.num-2].base + b.c[b.num-2].card : 0;
+  c.array = NULL;
+  c.bits = NULL;
+  c.before = NULL;
+  return c;
+}
+
+void *bmAlloc(size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) {
+    perror("bmAlloc()");
+    exit(1);
+  }
+  return p;
+}
+
+// find the container for a key (or NULL)
+const bmContainer *bmFind(const bitmap &b, uint16_t key) {
+  int lo = 0, hi = b.num;
+  while (lo < hi) {
+    int m = (lo+hi) >> 1;
+    if (b.c[m].key < key) lo = m+1; else hi = m;
+  }
+  return (lo < b.num && b.c[lo].key == key) ? &(b.c[lo]) : NULL;
+}
+
+// rank of id in the bitmap (-1 if it is not in the bitmap)
+inline int bmRank(const bitmap &b, uint32_t id) {
+  const bmContainer *c = bmFind(b, id >> 16);
+  if (c == NULL) return -1;
+
+  int low = id & 0xFFFF;
+  if (c->bits) {
+    uint64_t x = c->bits[low >> 6], bit = uint64_t(1) << (low & 63);
+    return (x & bit) ? c->base + c->before[low >> 6] + __builtin_popcountll(x & (bit-1)) : -1;
+  }
+
+  int a = 0, e = c->card;
+  while (a < e) {
+    int m = (a+e) >> 1;
+    if (c->array[m] < low) a = m+1; else e = m;
+  }
+  return (a < c->card && c->array[a] == low) ? c->base + a : -1;
+}
+
+// build a bitmap from an ascending list of unique ids
+void bmFromSorted(bitmap &b, const uint32_t *ids, int n) {
+  bmInit(b);
+  int i = 0;
+  while (i < n) {
+    uint16_t key = ids[i] >> 16;
+    int j = i;
+    while (j < n && (ids[j] >> 16) == key) j++;
+
+    bmContainer &c = bmAppend(b, key);
+    if (j-i > bmArrayMax) {
+      c.bits = (uint64_t*)bmAlloc(bmWords * sizeof *(c.bits));
+      c.before = (uint16_t*)bmAlloc(bmWords * sizeof *(c.before));
+      memset(c.bits, 0, bmWords * sizeof *(c.bits));
+      for (int k=i; k<j; ++k) c.bits[(ids[k] >> 6) & (bmWords-1)] |= uint64_t(1) << (ids[k] & 63);
+      for (int w=0, m=0; w<bmWords; m += __builtin_popcountll(c.bits[w++])) c.before[w] = m;
+    } else {
+      c.array = (uint16_t*)bmAlloc((j-i) * sizeof *(c.array) + 1);
+      for (int k=i; k<j; ++k) c.array[k-i] = ids[k] & 0xFFFF;
+    }
+    c.card = j-i;
+    i = j;
+  }
+}
+
+// number of ids in the bitmap
+long bmCardinality(const bitmap &b) {
+  long n = 0;
+  for (int i=0; i<b.num; ++i) n += b.c[i].card;
+  return n;
+}
+
+// memory used by the bitmap
+size_t bmBytes(const bitmap &b) {
+  size_t n = b.max * sizeof *(b.c);
+  for (int i=0; i<b.num; ++i)
+    n += b.c[i].bits ? bmWords * (sizeof(uint64_t) + sizeof(uint16_t)) : b.c[i].card * sizeof(uint16_t);
+  return n;
+}
+
+// number of ids in both containers
+int bmContainerAndCard(const bmContainer &x, const bmContainer &y) {
+  int n = 0;
+  if (x.bits && y.bits) {
+    for (int w=0; w<bmWords; ++w) n += __builtin_popcountll(x.bits[w] & y.bits[w]);
+  } else if (x.bits || y.bits) {
+    const bmContainer &a = x.bits ? y : x, &s = x.bits ? x : y;
+    for (int i=0; i<a.card; ++i) n += (s.bits[a.array[i] >> 6] >> (a.array[i] & 63)) & 1;
+  } else {
+    int i = 0, j = 0;
+    while (i < x.card && j < y.card) {
+      if (x.array[i] < y.array[j]) i++;
+      else if (y.array[j] < x.array[i]) j++;
+      else { n++; i++; j++; }
+    }
+  }
+  return n;
+}
+
+// number of ids in both bitmaps
+long bmAndCardinality(const bitmap &a, const bitmap &b) {
+  long n = 0;
+  int i = 0, j = 0;
+  while (i < a.num && j < b.num) {
+    if (a.c[i].key < b.c[j].key) i++;
+    else if (b.c[j].key < a.c[i].key) j++;
+    else n += bmContainerAndCard(a.c[i++], b.c[j++]);
+  }
+  return n;
+}
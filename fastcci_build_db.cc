@@ -1,76 +1,551 @@
 #include "fastcci.h"
+#include "fastcci_edges.h"
 #include "errno.h"
 
 int fd_cat, fd_tree;
-int maxtree = 1024*128, maxcat = 1024*128;
-tree_type *cat=NULL, *tree=NULL;
+size_t maxtree = 1024*128, maxcat = 1024*128;
+offset_type *cat=NULL;
+tree_type *tree=NULL;
 
-void growTree(int max=0) {
-  if (tree == NULL) {
-    if (ftruncate(fd_tree, maxtree * sizeof *tree))
+// the files are mapped with room for the header in front of the entries
+char *catmap=NULL, *treemap=NULL;
+const size_t hlen = sizeof(dbHeader);
+
+void growTree(size_t max=0) {
+  if (treemap == NULL) {
+    if (ftruncate(fd_tree, hlen + maxtree * sizeof *tree))
       printf("fruncate errno=%d fd=%d\n", errno, fd_tree);
 
-    tree = (tree_type*)mmap(NULL, maxtree * sizeof *tree, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd_tree, 0);
+    treemap = (char*)mmap(NULL, hlen + maxtree * sizeof *tree, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd_tree, 0);
   } else {
-    int old_maxtree = maxtree;
+    size_t old_maxtree = maxtree;
     maxtree *= 2;
     if (maxtree<=max) maxtree = max+1;
     
-    if (ftruncate(fd_tree, maxtree * sizeof *tree))
+    if (ftruncate(fd_tree, hlen + maxtree * sizeof *tree))
       printf("errno = %d\n", errno);
 
-    tree = (tree_type*)mremap(tree, old_maxtree * sizeof *tree,  maxtree * sizeof *tree, MREMAP_MAYMOVE);
+    treemap = (char*)mremap(treemap, hlen + old_maxtree * sizeof *tree, hlen + maxtree * sizeof *tree, MREMAP_MAYMOVE);
   }
   
   // check for allocation error
-  if (tree == MAP_FAILED) {
+  if (treemap == MAP_FAILED) {
     perror("growTree() MAP_FAILED");
     exit(1);
   }
-  if (tree == NULL) {
+  if (treemap == NULL) {
     perror("growTree()");
     exit(1);
   }
+  tree = (tree_type*)(treemap + hlen);
 
   // printf("grew tree to %d\n", maxtree);
 }
 
-void growCat(int max=0) {
-  int a = 0;
+void growCat(size_t max=0) {
+  size_t a = 0;
 
-  if (cat == NULL) {
-    if (ftruncate(fd_cat, maxcat * sizeof *cat))
+  if (catmap == NULL) {
+    if (ftruncate(fd_cat, hlen + maxcat * sizeof *cat))
       printf("fruncate errno=%d fd=%d\n", errno, fd_cat);
 
-    cat = (tree_type*)mmap(NULL, maxcat * sizeof *cat, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd_cat, 0);
+    catmap = (char*)mmap(NULL, hlen + maxcat * sizeof *cat, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd_cat, 0);
   } else {
     a = maxcat;
     maxcat *= 2;
     if (maxcat<=max) maxcat = max+1;
-    ftruncate(fd_cat, maxcat * sizeof *cat);
-    cat = (tree_type*)mremap(cat, a * sizeof *cat,  maxcat * sizeof *cat, MREMAP_MAYMOVE);
+    ftruncate(fd_cat, hlen + maxcat * sizeof *cat);
+    catmap = (char*)mremap(catmap, hlen + a * sizeof *cat, hlen + maxcat * sizeof *cat, MREMAP_MAYMOVE);
   }
 
   // check for allocation error
-  if (cat == MAP_FAILED) {
+  if (catmap == MAP_FAILED) {
     perror("growCat() MAP_FAILED");
     exit(1);
   }
-  if (cat == NULL) {
+  if (catmap == NULL) {
     perror("growCat() NULL");
     exit(1);
   }
+  cat = (offset_type*)(catmap + hlen);
 
   // initialize al cat entries to -1 (unused pageids are files)
-  for (int i=a; i<maxcat; ++i) cat[i] = -1;
+  for (size_t i=a; i<maxcat; ++i) cat[i] = -1;
 
   // printf("grew cat to %d\n", maxcat);
 }
 
 
+// the dump is read in chunks of chunkSize bytes, each chunk is split into parsePieces
+// line (or frame) aligned pieces that are parsed by the worker threads
+const size_t chunkSize = 32*1024*1024;
+const int parsePieces = 64;
+int nthreads = 1;
+
+// run fn on nthreads threads (the calling thread is one of them), fn claims its work
+// from a shared counter, so it does not matter how many threads could be started
+void runParallel(void *(*fn)(void *)) {
+  pthread_t *threads = (pthread_t*)malloc(nthreads * sizeof *threads);
+  if (threads == NULL) {
+    perror("runParallel()");
+    exit(1);
+  }
+  int started = 1;
+  for (int t=1; t<nthreads; ++t, ++started)
+    if (pthread_create(&(threads[t]), NULL, fn, NULL)) break;
+  fn(NULL);
+  for (int t=1; t<started; ++t) pthread_join(threads[t], NULL);
+  free(threads);
+}
+
+struct parsePiece {
+  const char *a, *b;
+  dumpEdge *edge;
+  int num, max;
+} piece[parsePieces];
+int nextPiece;
+
+// make room for n more edges in a piece
+void pieceGrow(parsePiece &pc, int n) {
+  if (pc.num + n <= pc.max) return;
+  while (pc.num + n > pc.max) pc.max = pc.max ? 2*pc.max : 1024*64;
+  if ((pc.edge = (dumpEdge*)realloc(pc.edge, pc.max * sizeof *(pc.edge))) == NULL) {
+    perror("pieceGrow()");
+    exit(1);
+  }
+}
+
+// parse the "cl_from cl_to cl_type" lines (malformed lines are skipped) or the edge
+// stream frames of a piece
+bool binaryInput = false;
+
+void *parseThread(void *) {
+  int k;
+  while ((k = __sync_fetch_and_add(&nextPiece, 1)) < parsePieces) {
+    parsePiece &pc = piece[k];
+    pc.num = 0;
+    const char *p = pc.a, *end = pc.b;
+    while (p < end) {
+      if (binaryInput) {
+        pieceGrow(pc, frameEdges);
+        int n = decodeFrame(p, &(pc.edge[pc.num]));
+        if (n < 0) {
+          fprintf(stderr, "Corrupt frame in the edge stream.\n");
+          exit(1);
+        }
+        pc.num += n;
+        p += frameLength(p, end - p);
+        continue;
+      }
+
+      const char *eol = (const char*)memchr(p, '\n', end - p);
+      if (eol == NULL) eol = end;
+      pieceGrow(pc, 1);
+      if (parseEdge(p, eol, pc.edge[pc.num])) pc.num++;
+      p = eol + 1;
+    }
+  }
+  return NULL;
+}
+
+// start offsets of all category blocks (their file lists are sorted in parallel)
+offset_type *block = NULL;
+size_t nblock = 0, maxblock = 0;
+size_t nextBlock;
+
+void *sortThread(void *) {
+  const size_t batch = 64;
+  size_t k;
+  while ((k = __sync_fetch_and_add(&nextBlock, batch)) < nblock)
+    for (size_t kend = k+batch < nblock ? k+batch : nblock; k<kend; ++k) {
+      offset_type c = block[k];
+      qsort(&(tree[subcatEnd(tree, c)]), tree[c+1], sizeof *tree, compare);
+    }
+  return NULL;
+}
+
+// tree construction state (the block of the category lcl_to is being filled)
+offset_type cstart=2, cfile=2, csubcat=2;
+int lcl_to=-1;
+
+// write the index entry and header of the category lcl_to
+void closeCategory() {
+  // make sure we have enough memory for the index
+  if (size_t(lcl_to)>=maxcat) growCat(lcl_to);
+
+  // write category index and category header (subcat and file list lengths)
+  cat[lcl_to] = cstart;
+  tree[cstart]   = csubcat - cstart - 2;
+  tree[cstart+1] = cfile - csubcat;
+
+  // remember the block to pre-sort its file list
+  if (nblock == maxblock) {
+    maxblock = maxblock ? 2*maxblock : 1024*64;
+    if ((block = (offset_type*)realloc(block, maxblock * sizeof *block)) == NULL) {
+      perror("closeCategory()");
+      exit(1);
+    }
+  }
+  block[nblock++] = cstart;
+}
+
+void addEdge(const dumpEdge &e) {
+  // new category?
+  if (e.to != lcl_to) {
+    if (lcl_to>0) closeCategory();
+
+    // expect a subcategory or a file
+    cstart = csubcat = cfile;
+    csubcat += 2;
+    cfile   += 2;
+  }
+
+  if (size_t(cfile)>=maxtree) growTree();
+
+  if (e.type=='s') {
+    // is the cat index of this subcategory still -1, then set it to the empty dummy cat 0
+    if (size_t(e.from)>=maxcat) growCat(e.from);
+    if (cat[e.from]==-1) cat[e.from]=0;
+
+    // no files in category yet?
+    if (csubcat==cfile) {
+      tree[csubcat++] = e.from;
+      cfile++;
+    } else {
+      // we already have a file at tree[subcat], move it to the end of cfile
+      tree[cfile++] = tree[csubcat];
+      tree[csubcat++] = e.from;
+    }
+  } else if (e.type=='f') {
+    // just append at cfile
+    tree[cfile++] = e.from;
+  }
+
+  lcl_to = e.to;
+}
+
+// unsorted input (-u) is collected in a buffer of sortMemory bytes, which is sorted by
+// category in nthreads slices. When the buffer is full the slices are merged into one
+// sorted run in a temporary file. At the end the runs are merged into the tree, at most
+// mergeFanIn at a time, with read buffers that share sortMemory.
+size_t sortMemory = size_t(1024)*1024*1024;
+const int mergeFanIn = 64;
+const size_t mergeMinBuffer = 1024;
+
+struct sortRun {
+  FILE *f;        // spilled run (NULL for a run in the buffer)
+  dumpEdge *edge; // the run in the buffer or the read buffer of a spilled run
+  size_t pos, num, max;
+};
+
+dumpEdge *sortBuf = NULL;
+size_t sortNum = 0, sortMax;
+sortRun *run = NULL, *slice = NULL;
+int nrun = 0, maxrun = 0, nslice = 0, nextSlice;
+
+inline bool edgeLess(const dumpEdge &a, const dumpEdge &b) {
+  if (a.to != b.to) return a.to < b.to;
+  if (a.from != b.from) return a.from < b.from;
+  return a.type < b.type;
+}
+
+int compareEdge(const void * a, const void * b) {
+  const dumpEdge &x = *(const dumpEdge*)a, &y = *(const dumpEdge*)b;
+  return edgeLess(x, y) ? -1 : (edgeLess(y, x) ? 1 : 0);
+}
+
+void *sortSliceThread(void *) {
+  int k;
+  while ((k = __sync_fetch_and_add(&nextSlice, 1)) < nslice)
+    qsort(slice[k].edge, slice[k].num, sizeof *(slice[k].edge), compareEdge);
+  return NULL;
+}
+
+// split the buffer into one slice per thread (as runs in memory) and sort them
+void sortSlices() {
+  if (slice == NULL && (slice = (sortRun*)malloc(nthreads * sizeof *slice)) == NULL) {
+    perror("sortSlices()");
+    exit(1);
+  }
+  nslice = 0;
+  for (int t=0; t<nthreads; ++t) {
+    size_t a = sortNum * t / nthreads, b = sortNum * (t+1) / nthreads;
+    if (a == b) continue;
+    sortRun &r = slice[nslice++];
+    r.f = NULL;
+    r.edge = &(sortBuf[a]);
+    r.pos = 0;
+    r.num = r.max = b - a;
+  }
+  nextSlice = 0;
+  runParallel(sortSliceThread);
+}
+
+// an empty run in a temporary file in the database directory (deleted when it is closed)
+FILE *tempRun() {
+  char name[] = "fastcci.sortXXXXXX";
+  int fd = mkstemp(name);
+  FILE *f = fd < 0 ? NULL : fdopen(fd, "w+");
+  if (f == NULL) {
+    perror("tempRun()");
+    exit(1);
+  }
+  unlink(name);
+  return f;
+}
+
+void addRun(FILE *f) {
+  if (nrun == maxrun) {
+    maxrun = maxrun ? 2*maxrun : 64;
+    if ((run = (sortRun*)realloc(run, maxrun * sizeof *run)) == NULL) {
+      perror("addRun()");
+      exit(1);
+    }
+  }
+  sortRun &r = run[nrun++];
+  r.f = f;
+  r.edge = NULL;
+  r.pos = r.num = r.max = 0;
+}
+
+// next edge of a run, false at its end
+inline bool runNext(sortRun &r, dumpEdge &e) {
+  if (r.pos == r.num) {
+    if (r.f == NULL) return false;
+    r.num = fread(r.edge, sizeof *(r.edge), r.max, r.f);
+    r.pos = 0;
+    if (r.num == 0) return false;
+  }
+  e = r.edge[r.pos++];
+  return true;
+}
+
+// restore the heap order of the runs below heap position i
+void siftDown(int *heap, int nheap, const dumpEdge *head, int i) {
+  while (true) {
+    int c = 2*i+1;
+    if (c >= nheap) return;
+    if (c+1 < nheap && edgeLess(head[heap[c+1]], head[heap[c]])) c++;
+    if (!edgeLess(head[heap[c]], head[heap[i]])) return;
+    int tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+// k-way merge of n runs (with a binary heap of the current edge of each run) into the
+// file out, or into the tree if out is NULL. Spilled runs get read buffers of buf edges
+// and are closed.
+void mergeInto(sortRun *r, int n, FILE *out, size_t buf) {
+  int *heap = (int*)malloc(n * sizeof *heap), nheap = 0;
+  dumpEdge *head = (dumpEdge*)malloc(n * sizeof *head);
+  if (heap == NULL || head == NULL) {
+    perror("mergeInto()");
+    exit(1);
+  }
+  for (int k=0; k<n; ++k) {
+    if (r[k].f != NULL) {
+      rewind(r[k].f);
+      r[k].num = r[k].pos = 0;
+      r[k].max = buf;
+      if ((r[k].edge = (dumpEdge*)malloc(buf * sizeof *(r[k].edge))) == NULL) {
+        perror("mergeInto()");
+        exit(1);
+      }
+    }
+    if (runNext(r[k], head[k])) heap[nheap++] = k;
+  }
+
+  // heapify, then repeatedly take the smallest edge and replace it by the next one of its run
+  for (int h=nheap/2-1; h>=0; --h) siftDown(heap, nheap, head, h);
+  while (nheap > 0) {
+    int k = heap[0];
+    if (out == NULL)
+      addEdge(head[k]);
+    else if (fwrite(&(head[k]), sizeof *head, 1, out) != 1) {
+      perror("mergeInto() fwrite");
+      exit(1);
+    }
+    if (!runNext(r[k], head[k])) heap[0] = heap[--nheap];
+    siftDown(heap, nheap, head, 0);
+  }
+
+  for (int k=0; k<n; ++k)
+    if (r[k].f != NULL) {
+      fclose(r[k].f);
+      free(r[k].edge);
+    }
+  free(heap);
+  free(head);
+}
+
+// merge the sorted slices of the buffer into one run in a temporary file
+void spillRun() {
+  sortSlices();
+  FILE *f = tempRun();
+  mergeInto(slice, nslice, f, 0);
+  if (fflush(f) != 0) {
+    perror("spillRun()");
+    exit(1);
+  }
+  addRun(f);
+  sortNum = 0;
+}
+
+void collectEdges(const dumpEdge *edge, size_t n) {
+  if (sortBuf == NULL) {
+    sortMax = sortMemory / sizeof *sortBuf;
+    if (sortMax < size_t(nthreads)) sortMax = nthreads;
+    if ((sortBuf = (dumpEdge*)malloc(sortMax * sizeof *sortBuf)) == NULL) {
+      perror("collectEdges()");
+      exit(1);
+    }
+  }
+  while (n > 0) {
+    if (sortNum == sortMax) spillRun();
+    size_t m = sortMax - sortNum < n ? sortMax - sortNum : n;
+    memcpy(&(sortBuf[sortNum]), edge, m * sizeof *edge);
+    sortNum += m;
+    edge += m;
+    n -= m;
+  }
+}
+
+// merge all runs into the tree (the slices in memory if nothing was spilled)
+void mergeRuns() {
+  if (nrun == 0) {
+    sortSlices();
+    printf("merging %d sorted slices.\n", nslice);
+    mergeInto(slice, nslice, NULL, 0);
+  } else {
+    if (sortNum > 0) spillRun();
+    free(sortBuf);
+    sortBuf = NULL;
+    printf("merging %d sorted runs.\n", nrun);
+
+    // merge groups of mergeFanIn runs into new runs until a single pass is left
+    size_t buf = sortMemory / sizeof(dumpEdge) / (nrun < mergeFanIn ? nrun : mergeFanIn);
+    if (buf < mergeMinBuffer) buf = mergeMinBuffer;
+    while (nrun > mergeFanIn) {
+      int n = nrun, m = 0;
+      sortRun *old = run;
+      run = NULL;
+      nrun = maxrun = 0;
+      for (int k=0; k<n; k+=mergeFanIn, ++m) {
+        FILE *f = tempRun();
+        mergeInto(&(old[k]), n-k < mergeFanIn ? n-k : mergeFanIn, f, buf);
+        if (fflush(f) != 0) {
+          perror("mergeRuns()");
+          exit(1);
+        }
+        addRun(f);
+      }
+      free(old);
+      printf("merged into %d runs.\n", nrun);
+      buf = sortMemory / sizeof(dumpEdge) / (nrun < mergeFanIn ? nrun : mergeFanIn);
+      if (buf < mergeMinBuffer) buf = mergeMinBuffer;
+    }
+    mergeInto(run, nrun, NULL, buf);
+  }
+  free(run);
+  free(slice);
+  free(sortBuf);
+}
+
+// categories are verified in ranges of verifyBatch, the error in the lowest category is reported
+const int verifyBatch = 4096;
+int nextVerify, verifyError = -1;
+tree_type verifyPage;
+const char *verifyFormat;
+pthread_mutex_t verifyMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// record an error (the format takes the category and the offending page id)
+void verifyFail(int i, const char *fmt, tree_type v=0) {
+  pthread_mutex_lock(&verifyMutex);
+  if (verifyError < 0 || i < verifyError) {
+    verifyError = i;
+    verifyFormat = fmt;
+    verifyPage = v;
+  }
+  pthread_mutex_unlock(&verifyMutex);
+}
+
+void *verifyThread(void *) {
+  int i;
+  while ((i = __sync_fetch_and_add(&nextVerify, verifyBatch)) <= lcl_to)
+    for (int iend = i+verifyBatch <= lcl_to ? i+verifyBatch : lcl_to+1; i<iend; ++i) {
+      offset_type c = cat[i];
+      if (c<0) continue;
+
+      if (tree[c]<0) {
+        verifyFail(i, "Negative subcat block length in cat %1$d\n");
+        continue;
+      }
+      if (tree[c+1]<0) {
+        verifyFail(i, "Negative file block length in cat %1$d\n");
+        continue;
+      }
+
+      offset_type cend = subcatEnd(tree, c), cf = fileEnd(tree, c);
+      c += 2;
+
+      // verify subcats
+      for (; c<cend; c++)
+        if (cat[tree[c]] < 0) {
+          verifyFail(i, "File %2$d in subcat block of cat %1$d\n", tree[c]);
+          break;
+        }
+
+      // verify files (page ids past the index are files)
+      for (; c<cf; c++)
+        if (size_t(tree[c]) < maxcat && cat[tree[c]] != -1) {
+          verifyFail(i, "Category %2$d in file block of cat %1$d\n", tree[c]);
+          break;
+        }
+    }
+  return NULL;
+}
+
+
 int main(int argc, char *argv[]) {
   int i, j;
 
+  // parse command line options
+  bool packed = false, dense = false, reorder = false, unsorted = false;
+  int opt;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "zdoj:um:")) != -1) {
+    switch (opt) {
+      case 'z':
+        packed = true;
+        break;
+      case 'd':
+        dense = true;
+        break;
+      case 'o':
+        reorder = true;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      case 'u':
+        unsorted = true;
+        break;
+      case 'm':
+        if (atoi(optarg) <= 0) {
+          fprintf(stderr, "Invalid sort buffer size %s.\n", optarg);
+          return 1;
+        }
+        sortMemory = size_t(atoi(optarg)) * 1024*1024;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-z] [-d] [-o] [-j THREADS] [-u [-m SORT_MB]] < dump\n", argv[0]);
+        return 1;
+    }
+  }
+  if (nthreads < 1) nthreads = 1;
+
   // file descriptors for mmap
   fd_cat = open("fastcci.cat", O_RDWR|O_CREAT, 0744);
   if (fd_cat == -1) {
@@ -87,115 +562,323 @@ int main(int argc, char *argv[]) {
   growTree();
 
   // insert empty dummy category at tree[0]
-  int cstart=2, cfile=2, csubcat=2;
-  tree[0] = 2;
-  tree[1] = 2;
-
-  // read data dump line by line
-  char buf[200], type[10];
-  int cl_from, cl_to, lcl_to=-1;
-  int expect; // 0:sf, 1:f
-  while (!feof(stdin)) {
-    if (fgets(buf, 200, stdin)) {
-      sscanf(buf,"%d %d %s", &cl_from, &cl_to, type);
-
-      // new category?
-      if (cl_to != lcl_to) {
-        if (lcl_to>0) {
-          // make sure we have enough memory for the index
-          if (lcl_to>=maxcat) growCat(lcl_to);
-
-          // write category index and category header
-          cat[lcl_to] = cstart;
-          tree[cstart]   = csubcat;
-          tree[cstart+1] = cfile;
-
-          // pre-sort the file list
-          qsort(&(tree[csubcat]),cfile-csubcat,sizeof *tree,compare);
-
-          // expect a subcategory or a file
-        }
-        cstart = csubcat = cfile;
-        csubcat += 2;
-        cfile   += 2;
+  tree[0] = 0;
+  tree[1] = 0;
+
+  // read the dump (text or a binary edge stream) in chunks, parse each chunk in parallel
+  // and append its edges in order (or collect them for sorting)
+  char *dump = (char*)malloc(chunkSize);
+  if (dump == NULL) {
+    perror("dump");
+    exit(1);
+  }
+  size_t len = 0;
+  bool eof = false, first = true;
+  while (!eof) {
+    while (len < chunkSize) {
+      ssize_t n = read(0, dump + len, chunkSize - len);
+      if (n < 0) {
+        perror("read");
+        exit(1);
+      }
+      if (n == 0) {
+        eof = true;
+        break;
       }
+      len += n;
+    }
 
-      if (cfile>=maxtree) growTree();
-
-      if (type[0]=='s') {
-        // is the cat index of this subcategory still -1, then set it to the empty dummy cat 0
-        if (cl_from>=maxcat) growCat(cl_from);
-        if (cat[cl_from]==-1) cat[cl_from]=0;
-
-        // no files in category yet?
-        if (csubcat==cfile) {
-          tree[csubcat++] = cl_from;
-          cfile++;
-        } else {
-          // we already have a file at tree[subcat], move it to the end of cfile
-          //fprintf(stderr,"out of order subcat!\n");
-          tree[cfile++] = tree[csubcat];
-          tree[csubcat++] = cl_from;
-        }
-      } else if (type[0]=='f') {
-        // just append at cfile
-        tree[cfile++] = cl_from;
+    if (first) {
+      binaryInput = isEdgeStream(dump, len);
+      first = false;
+    }
+
+    // parse up to the last complete line (a line longer than a chunk is cut) or frame
+    size_t used = len;
+    if (binaryInput) {
+      long l;
+      used = 0;
+      while ((l = frameLength(dump + used, len - used)) > 0) used += l;
+      if (l < 0 || (eof && used < len)) {
+        fprintf(stderr, "%s frame in the edge stream.\n", l < 0 ? "Invalid" : "Truncated");
+        exit(1);
       }
+    } else if (!eof) {
+      const char *nl = (const char*)memrchr(dump, '\n', len);
+      if (nl) used = nl - dump + 1;
+    }
 
-      lcl_to = cl_to;
+    // split at line (or frame) boundaries
+    const char *p = dump, *end = dump + used;
+    for (int k=0; k<parsePieces; ++k) {
+      const char *b = dump + used * (k+1) / parsePieces;
+      if (b < p) b = p;
+      if (binaryInput) {
+        const char *f = p;
+        while (f < b) f += frameLength(f, end - f);
+        b = f;
+      } else if (b < end) {
+        const char *nl = (const char*)memchr(b, '\n', end - b);
+        b = nl ? nl + 1 : end;
+      }
+      piece[k].a = p;
+      piece[k].b = b;
+      p = b;
     }
-  }
 
-  // make sure we have enough memory for the index
-  if (lcl_to>=maxcat) growCat(lcl_to);
+    nextPiece = 0;
+    runParallel(parseThread);
+    for (int k=0; k<parsePieces; ++k)
+      if (unsorted)
+        collectEdges(piece[k].edge, piece[k].num);
+      else
+        for (int e=0; e<piece[k].num; ++e) addEdge(piece[k].edge[e]);
 
-  // close final category header
-  cat[lcl_to] = cstart;
-  tree[cstart]   = csubcat;
-  tree[cstart+1] = cfile;
-  qsort(&(tree[csubcat]),cfile-csubcat,sizeof(int),compare);
+    memmove(dump, dump + used, len - used);
+    len -= used;
+  }
+  free(dump);
+  for (int k=0; k<parsePieces; ++k) free(piece[k].edge);
+  if (unsorted) mergeRuns();
+
+  // close final category header and pre-sort the file lists
+  closeCategory();
+  offset_type ntree = cfile;
+  nextBlock = 0;
+  runParallel(sortThread);
+  free(block);
 
   // verify data
-  for (int i=0; i<=lcl_to; ++i) {
-    cstart = cat[i];
-    if (cstart<0) continue;
+  nextVerify = 0;
+  runParallel(verifyThread);
+  if (verifyError >= 0) {
+    fprintf(stderr, verifyFormat, verifyError, verifyPage);
+    exit(1);
+  }
 
-    csubcat = tree[cstart];
-    cfile = tree[cstart+1];
+  // breadth first order of the categories, starting from the categories without parents
+  // (in page id order) and then from the remaining ones (which are only reachable from cycles)
+  tree_type *catorder = NULL;
+  int norder = 0;
+  if (reorder) {
+    char *seen = (char*)calloc(maxcat, 1); // 1: has a parent, 2: visited
+    catorder = (tree_type*)malloc(maxcat * sizeof *catorder);
+    if (seen == NULL || catorder == NULL) {
+      perror("reorder");
+      exit(1);
+    }
+    for (i=0; i<=lcl_to; ++i)
+      if (cat[i] > 0)
+        for (offset_type k=cat[i]+2; k<subcatEnd(tree, cat[i]); ++k)
+          seen[tree[k]] = 1;
+
+    for (int pass=0; pass<2; ++pass)
+      for (j=0; size_t(j)<maxcat; ++j) {
+        if (cat[j] < 0 || seen[j] == 2 || (pass == 0 && seen[j] == 1)) continue;
+
+        int head = norder;
+        seen[j] = 2;
+        catorder[norder++] = j;
+        while (head < norder) {
+          int v = catorder[head++];
+          if (cat[v] <= 0) continue;
+          for (offset_type k=cat[v]+2; k<subcatEnd(tree, cat[v]); ++k)
+            if (seen[tree[k]] != 2) {
+              seen[tree[k]] = 2;
+              catorder[norder++] = tree[k];
+            }
+        }
+      }
+    free(seen);
 
-    cstart += 2;
+    // lay out the blocks in that order, so that the subcategories of a category (and
+    // the categories of a traversal level) are stored close to each other
+    tree_type *buf = (tree_type*)malloc(ntree * sizeof *buf);
+    if (buf == NULL) {
+      perror("reorder");
+      exit(1);
+    }
+    offset_type pos = 2;
+    buf[0] = buf[1] = 0;
+    for (int k=0; k<norder; ++k) {
+      offset_type c = cat[catorder[k]];
+      if (c <= 0) continue;
+
+      size_t len = fileEnd(tree, c) - c;
+      memcpy(&(buf[pos]), &(tree[c]), len * sizeof *buf);
+      cat[catorder[k]] = pos;
+      pos += len;
+    }
+    memcpy(tree, buf, ntree * sizeof *tree);
+    free(buf);
+    printf("reordered %d categories.\n", norder);
+  }
 
-    if (csubcat<cstart) {
-      fprintf(stderr,"Negative subcat block length in cat %d\n", i);
+  // number the pages densely (categories first, in page id order or in the breadth first
+  // order of the layout, then files in page id order)
+  int ncat = lcl_to+1;
+  if (dense) {
+    // largest page id in the graph (subcategories can lie past the last block)
+    tree_type maxid = maxcat-1;
+    for (i=0; i<=lcl_to; ++i)
+      if (cat[i] > 0)
+        for (offset_type k=subcatEnd(tree, cat[i]); k<fileEnd(tree, cat[i]); ++k)
+          if (tree[k] > maxid) maxid = tree[k];
+
+    // dense id of every page id (-1 for page ids that are not in the graph)
+    tree_type *denseid = (tree_type*)malloc((size_t(maxid)+1) * sizeof *denseid);
+    if (denseid == NULL) {
+      perror("denseid");
       exit(1);
     }
-    if (cfile<csubcat) {
-      fprintf(stderr,"Negative file block length in cat %d\n", i);
+    for (j=0; j<=maxid; ++j) denseid[j] = -1;
+    for (i=0; i<=lcl_to; ++i)
+      if (cat[i] > 0)
+        for (offset_type k=subcatEnd(tree, cat[i]); k<fileEnd(tree, cat[i]); ++k)
+          denseid[tree[k]] = -2;
+    int n = 0;
+    if (reorder)
+      for (n=0; n<norder; ++n) denseid[catorder[n]] = n;
+    else
+      for (j=0; size_t(j)<maxcat; ++j)
+        if (cat[j] >= 0) denseid[j] = n++;
+    int ncategory = n;
+    for (j=0; j<=maxid; ++j)
+      if (denseid[j] == -2) denseid[j] = n++;
+
+    // mapping tables (page id of each dense id, dense ids in page id order)
+    tree_type *pageid = (tree_type*)malloc(n * sizeof *pageid), *order = (tree_type*)malloc(n * sizeof *order);
+    offset_type *dcat = (offset_type*)malloc(n * sizeof *dcat);
+    if (pageid == NULL || order == NULL || dcat == NULL) {
+      perror("dense ids");
       exit(1);
     }
-
-    // verify subcats
-    for (; cstart<csubcat; cstart++)
-      if (cat[tree[cstart]] < 0 ) {
-        fprintf(stderr,"File %d in subcat block of cat %d\n", tree[cstart], i);
-        exit(1);
+    int m = 0;
+    for (j=0; j<=maxid; ++j)
+      if (denseid[j] >= 0) {
+        pageid[denseid[j]] = j;
+        order[m++] = denseid[j];
+        dcat[denseid[j]] = (size_t(j)<maxcat) ? cat[j] : -1;
       }
 
-    // verify files
-    for (; cstart<cfile; cstart++)
-      if (cat[tree[cstart]] != -1 ) {
-        fprintf(stderr,"Category %d in file block of cat %d\n", tree[cstart], i);
-        exit(1);
-      }
+    // renumber the children of every block (the file lists stay sorted)
+    for (i=0; i<=lcl_to; ++i)
+      if (cat[i] > 0)
+        for (offset_type k=cat[i]+2; k<fileEnd(tree, cat[i]); ++k)
+          tree[k] = denseid[tree[k]];
+
+    // move the category index to dense ids
+    if (size_t(n)>maxcat) growCat(n);
+    memcpy(cat, dcat, n * sizeof *cat);
+    ncat = n;
+    for (int k=0; k<norder; ++k) catorder[k] = denseid[catorder[k]];
+
+    if (!dbWriteFile("fastcci.ids", DB_IDS, 0, pageid, n) ||
+        !dbWriteFile("fastcci.idorder", DB_IDORDER, 0, order, n)) {
+      perror("fastcci.ids/idorder");
+      exit(1);
+    }
+    printf("dense ids: %d categories, %d files (largest page id %d).\n", ncategory, n-ncategory, maxid);
+    free(denseid);
+    free(pageid);
+    free(order);
+    free(dcat);
+  } else {
+    unlink("fastcci.ids");
+    unlink("fastcci.idorder");
+  }
+
+  // build the reverse (child to parent) index
+  offset_type *rcat;
+  tree_type *rtree;
+  int nrcat;
+  size_t nrtree;
+  buildReverseIndex(cat, ncat, tree, false, rcat, nrcat, rtree, nrtree);
+
+  // write out reverse index files
+  if (!dbWriteFile("fastcci.rcat", DB_RCAT, 0, rcat, nrcat) ||
+      !dbWriteFile("fastcci.rtree", DB_RTREE, 0, rtree, nrtree)) {
+    perror("fastcci.rcat/rtree");
+    exit(1);
   }
+  free(rcat);
+  free(rtree);
+
+  // write out the subcategory index (the category graph without file lists)
+  offset_type *scat;
+  tree_type *stree;
+  int nscat;
+  size_t nstree;
+  buildSubcatIndex(cat, ncat, tree, scat, nscat, stree, nstree);
+  if (!dbWriteFile("fastcci.scat", DB_SCAT, 0, scat, nscat) ||
+      !dbWriteFile("fastcci.stree", DB_STREE, 0, stree, nstree)) {
+    perror("fastcci.scat/stree");
+    exit(1);
+  }
+  free(scat);
+  free(stree);
+
+  // write a tree file with packed file lists (and point the cat index to its blocks)
+  if (packed) {
+    FILE *fpacked = fopen("fastcci.tree.packed", "w");
+    if (fpacked == NULL) {
+      perror("fastcci.tree.packed");
+      exit(1);
+    }
+
+    tree_type h[2] = {0, 0}, *buf = NULL;
+    offset_type pos = 2;
+    int maxbuf = 0;
+    bool ok = dbWriteHeader(fpacked, DB_TREE, dbPacked, 0, 0) && fwrite(h, sizeof *h, 2, fpacked) == 2;
+    uint64_t sum = dbChecksum(h, sizeof h);
+    for (int k=0; ok && k<(reorder ? norder : ncat); ++k) {
+      i = reorder ? catorder[k] : k;
+      cstart = cat[i];
+      if (cstart<=0) continue;
+
+      int nsub = tree[cstart], nfile = tree[cstart+1];
+      if (nfile+1 > maxbuf) {
+        maxbuf = nfile+1;
+        if ((buf = (tree_type*)realloc(buf, maxbuf * sizeof *buf)) == NULL) {
+          perror("packFiles()");
+          exit(1);
+        }
+      }
+      int nword = packFiles(&(tree[subcatEnd(tree, cstart)]), nfile, buf);
+
+      h[0] = nsub;
+      h[1] = nword;
+      ok = fwrite(h, sizeof *h, 2, fpacked) == 2 &&
+           fwrite(&(tree[cstart+2]), sizeof *tree, nsub, fpacked) == (size_t)nsub &&
+           fwrite(buf, sizeof *buf, nword, fpacked) == (size_t)nword;
+      sum = dbChecksum(buf, nword * sizeof *buf, dbChecksum(&(tree[cstart+2]), nsub * sizeof *tree, dbChecksum(h, sizeof h, sum)));
+      cat[i] = pos;
+      pos += 2 + nsub + nword;
+    }
+    free(buf);
+    ok = ok && dbWriteHeader(fpacked, DB_TREE, dbPacked, pos, sum);
+    if (fclose(fpacked) != 0 || !ok) {
+      perror("fwrite");
+      exit(1);
+    }
+    printf("packed tree: %ld of %ld entries.\n", long(pos), long(ntree));
+  } else
+    dbFillHeader(*(dbHeader*)treemap, DB_TREE, 0, ntree, dbChecksum(tree, ntree * sizeof *tree));
+  dbFillHeader(*(dbHeader*)catmap, DB_CAT, dense ? dbDense : 0, ncat, dbChecksum(cat, ncat * sizeof *cat));
+
+  free(catorder);
 
   // write out binary tree files
-  munmap(cat, maxcat * sizeof *cat);
-  munmap(tree, maxtree * sizeof *tree);
-  ftruncate(fd_tree, cfile * sizeof *tree);
-  ftruncate(fd_cat, (lcl_to+1) * sizeof *cat);
+  munmap(catmap, hlen + maxcat * sizeof *cat);
+  munmap(treemap, hlen + maxtree * sizeof *tree);
+  ftruncate(fd_tree, hlen + ntree * sizeof *tree);
+  ftruncate(fd_cat, hlen + ncat * sizeof *cat);
   close(fd_tree);
   close(fd_cat);
+  if (packed && rename("fastcci.tree.packed", "fastcci.tree") != 0) {
+    perror("rename");
+    exit(1);
+  }
 
   printf("db files written.\n");
 
@@ -5,21 +5,15 @@
 #endif
 #include <string.h>
 
-int readFile(const char *fname, int* &buf) {
-  FILE *in = fopen(fname,"rb");
-  fseek(in, 0L, SEEK_END);
-  int sz = ftell(in);
-  fseek(in, 0L, SEEK_SET);
-  buf = (int*)malloc(sz);
-  fread(buf, 1, sz, in);
-  return sz;
-}
+#include "fastcci.h"
 
 const int maxdepth=30000;
 int history[maxdepth];
 int subcatcount;
-int *cat; 
-int *tree; 
+offset_type *cat;
+tree_type *tree;
+offset_type *scat;
+tree_type *stree;
 char *mask;
 int *unmask;
 
@@ -59,22 +53,20 @@ void tagCat(int id, int depth) {
   // mark as visited
   mask[id] = 1;
   unmask[subcatcount++] = id;
-  int c = cat[id], cend = tree[c];
-  c += 2;
+  offset_type c = scat[id], cend = scat[id+1];
   while (c<cend) {
-    tagCat(tree[c], depth+1);
+    tagCat(stree[c], depth+1);
     c++; 
   }
 }
 
 int main() {
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
+  readSubcats("..", cat, maxcat, tree, scat, stree);
   mask = (char*)malloc(maxcat);
   unmask = (int*)malloc(maxcat);
 
-  readFile("../fastcci.tree", tree);
-
   int maxsubcatcount = 0;
   memset(mask,0,maxcat);
 
@@ -95,7 +87,5 @@ int main() {
     }
   }
 
-  free(cat);
-  free(tree);
   return 0;
 }
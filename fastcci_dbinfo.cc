@@ -8,14 +8,13 @@
 #include "fastcci.h"
 
 // the graph
-int *cat;
+offset_type *cat;
 tree_type *tree;
 
 int main() {
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
-
-  readFile("../fastcci.tree", tree);
+  bool packed, dense;
+  dbVerify = true;
+  int maxcat = readGraph("..", cat, tree, &packed, &dense);
 
   double filecount = 0, catcount = 0, catrelcount = 0, fileincatcount = 0;
 
@@ -24,9 +23,9 @@ int main() {
     if (cat[v]>-1)
     {
       catcount++;
-      int i = cat[v], cstart = i+2, cend = tree[i], cfile = tree[i+1];
-      catrelcount += cend-cstart;
-      fileincatcount += cfile-cend;
+      offset_type i = cat[v];
+      catrelcount += tree[i];
+      fileincatcount += fileCount(tree, subcatEnd(tree, i), fileEnd(tree, i), packed);
     }
     else
       filecount++;
@@ -37,8 +36,6 @@ int main() {
   printf("%f 'category is subcategory of' relations\n", catrelcount);
   printf("%f 'file is in category' relations\n", fileincatcount);
 
-  free(cat);
-  free(tree);
 
   return 0;
 }
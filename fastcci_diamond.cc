@@ -16,12 +16,13 @@
  */
 
 int main(int argc, char *argv[]) {
-  int *cat;
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
-
+  offset_type *cat;
   tree_type *tree;
-  readFile("../fastcci.tree", tree);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
+  offset_type *scat;
+  tree_type *stree;
+  readSubcats("..", cat, maxcat, tree, scat, stree);
 
   // subsubcat masks
   int *ssm1 = (int*)malloc(maxcat * sizeof(int));
@@ -33,25 +34,25 @@ int main(int argc, char *argv[]) {
   for (int v=0; v<maxcat; ++v)
     if (cat[v]>-1)
     {
-      int i = cat[v], cstart = i+2, cend = tree[i];
+      offset_type cstart = scat[v], cend = scat[v+1];
       // go over sub cats and tag sub sub cats
-      for (int w=cstart; w<cend; ++w) 
+      for (offset_type w=cstart; w<cend; ++w) 
       {
-        int j = cat[tree[w]], scstart = j+2, scend = tree[j];
+        offset_type scstart = scat[stree[w]], scend = scat[stree[w]+1];
 
         // go over sub sub cats and tag
-        for (int x=scstart; x<scend; ++x) 
+        for (offset_type x=scstart; x<scend; ++x) 
         {
-          if (ssm1[tree[x]] == v)
+          if (ssm1[stree[x]] == v)
           {
             // we've already seen this subsubcat from another subcat
-            printf("%d|%d|%d|%d\n", v, ssm2[tree[x]], tree[w], tree[x]); 
+            printf("%d|%d|%d|%d\n", v, ssm2[stree[x]], stree[w], stree[x]); 
             nummatch++;
           }
           else  
           {
-            ssm1[tree[x]] = v;
-            ssm2[tree[x]] = tree[w];
+            ssm1[stree[x]] = v;
+            ssm2[stree[x]] = stree[w];
           }
         }
       }
@@ -59,7 +60,5 @@ int main(int argc, char *argv[]) {
 
   printf("\n%d diamonds found.\n", nummatch);
 
-  free(cat);
-  free(tree);
   return 0;
 }
@@ -0,0 +1,128 @@
+// edges of a categorylinks dump, as text lines (cl_from cl_to cl_type) or as a binary
+// edge stream. The binary stream is a sequence of frames, each frame is an edgeFrame
+// header followed by its payload (padded to a multiple of four bytes). The payload holds
+// the varint encoded edges of the frame: the difference to the cl_to of the previous
+// edge (zigzag encoded, the first edge of a frame is relative to 0) and cl_from shifted
+// left by two bits with the edge type in the low bits. Frames are independent of each
+// other, so they can be decoded in parallel.
+
+// an edge of the dump (cl_from, cl_to, first letter of cl_type)
+struct dumpEdge {
+  tree_type from, to;
+  char type;
+};
+
+const uint32_t frameMagic = 0x45434346; // "FCCE"
+const uint32_t frameVersion = 1;
+const int frameEdges = 1024*64; // maximum number of edges per frame
+
+struct edgeFrame {
+  uint32_t magic, version;
+  uint32_t count;    // number of edges
+  uint32_t bytes;    // length of the payload
+  uint64_t checksum; // of the payload (see dbChecksum)
+};
+
+// maximum payload length of a frame of n edges
+inline size_t frameMaxBytes(int n) {
+  return size_t(n) * 15 + 3;
+}
+
+// does the data start with a frame?
+inline bool isEdgeStream(const char *p, size_t len) {
+  uint32_t m;
+  if (len < sizeof m) return false;
+  memcpy(&m, p, sizeof m);
+  return m == frameMagic;
+}
+
+// parse a (possibly negative) decimal integer, returns NULL if there are no digits
+inline const char *parseInt(const char *p, const char *end, tree_type &v) {
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  bool neg = p < end && *p == '-';
+  if (neg) p++;
+  if (p == end || *p < '0' || *p > '9') return NULL;
+  v = 0;
+  while (p < end && *p >= '0' && *p <= '9') v = v*10 + (*p++ - '0');
+  if (neg) v = -v;
+  return p;
+}
+
+// parse a "cl_from cl_to cl_type" line (without the newline), false if it is malformed
+inline bool parseEdge(const char *p, const char *eol, dumpEdge &e) {
+  p = parseInt(p, eol, e.from);
+  if (p) p = parseInt(p, eol, e.to);
+  if (p == NULL) return false;
+  while (p < eol && (*p == ' ' || *p == '\t')) p++;
+  if (p == eol) return false;
+  e.type = *p;
+  return true;
+}
+
+// type codes of the binary stream (all types other than subcat and file are stored as page)
+inline int edgeTypeCode(char type) {
+  return type == 's' ? 0 : (type == 'f' ? 1 : 2);
+}
+
+inline const char *edgeTypeName(char type) {
+  return type == 's' ? "subcat" : (type == 'f' ? "file" : "page");
+}
+
+// write the n edges (at most frameEdges) as a frame to out (of at least
+// sizeof(edgeFrame) + frameMaxBytes(n) bytes), returns the length of the frame
+size_t encodeFrame(const dumpEdge *edge, int n, char *out) {
+  unsigned char *p0 = (unsigned char*)out + sizeof(edgeFrame), *p = p0;
+  int64_t last = 0;
+  for (int i=0; i<n; ++i) {
+    int64_t d = int64_t(edge[i].to) - last;
+    p = putVarint(p, uint64_t((d << 1) ^ (d >> 63)));
+    p = putVarint(p, (uint64_t(uint32_t(edge[i].from)) << 2) | edgeTypeCode(edge[i].type));
+    last = edge[i].to;
+  }
+  while ((p - p0) & 3) *p++ = 0;
+
+  edgeFrame h;
+  h.magic = frameMagic;
+  h.version = frameVersion;
+  h.count = n;
+  h.bytes = p - p0;
+  h.checksum = dbChecksum(p0, h.bytes);
+  memcpy(out, &h, sizeof h);
+  return sizeof h + h.bytes;
+}
+
+// length of the complete frame at p (0 if the frame is cut off at p+len, -1 if p does
+// not hold a valid frame header)
+long frameLength(const char *p, size_t len) {
+  edgeFrame h;
+  if (len < sizeof h) return 0;
+  memcpy(&h, p, sizeof h);
+  if (h.magic != frameMagic || h.version != frameVersion || h.count > uint32_t(frameEdges) ||
+      h.bytes > frameMaxBytes(h.count) || (h.bytes & 3)) return -1;
+  return len < sizeof h + h.bytes ? 0 : long(sizeof h + h.bytes);
+}
+
+// decode the complete frame at p into out (of at least frameEdges entries), returns the
+// number of edges or -1 if the frame is corrupt
+int decodeFrame(const char *p, dumpEdge *out) {
+  edgeFrame h;
+  memcpy(&h, p, sizeof h);
+  const unsigned char *q = (const unsigned char*)p + sizeof h, *end = q + h.bytes;
+  if (dbChecksum(q, h.bytes) != h.checksum) return -1;
+
+  int64_t last = 0;
+  uint64_t d, f;
+  for (uint32_t i=0; i<h.count; ++i) {
+    if ((q = getVarint(q, end, d)) == NULL || (q = getVarint(q, end, f)) == NULL) return -1;
+    last += int64_t(d >> 1) ^ -int64_t(d & 1);
+    out[i].to = last;
+    out[i].from = uint32_t(f >> 2);
+    out[i].type = "sfp?"[f & 3];
+  }
+
+  // only the padding may follow the edges
+  if (end - q > 3) return -1;
+  for (; q < end; ++q)
+    if (*q != 0) return -1;
+  return h.count;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#if !defined(__APPLE__)
+#include <malloc.h>
+#endif
+#include <string.h>
+
+#include "fastcci.h"
+#include "fastcci_edges.h"
+
+/**
+ * Convert a text dump (cl_from cl_to cl_type lines, as read by fastcci_build_db) into a
+ * binary edge stream, or with -d a binary edge stream back into text.
+ *
+ *   fastcci_edgestream [-d] < input > output
+ */
+
+void fail(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(1);
+}
+
+// write the buffered edges as a frame
+void flush(const dumpEdge *edge, int n, char *frame) {
+  if (n == 0) return;
+  size_t len = encodeFrame(edge, n, frame);
+  if (fwrite(frame, 1, len, stdout) != len) {
+    perror("fwrite");
+    exit(1);
+  }
+}
+
+int encode() {
+  dumpEdge *edge = (dumpEdge*)malloc(frameEdges * sizeof *edge);
+  char *frame = (char*)malloc(sizeof(edgeFrame) + frameMaxBytes(frameEdges));
+  if (edge == NULL || frame == NULL) {
+    perror("encode()");
+    exit(1);
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int n = 0;
+  long total = 0, skipped = 0;
+  while ((len = getline(&line, &size, stdin)) >= 0) {
+    if (len > 0 && line[len-1] == '\n') len--;
+    if (!parseEdge(line, line + len, edge[n])) {
+      skipped++;
+      continue;
+    }
+    total++;
+    if (++n == frameEdges) {
+      flush(edge, n, frame);
+      n = 0;
+    }
+  }
+  flush(edge, n, frame);
+
+  fprintf(stderr, "%ld edges written, %ld malformed lines skipped.\n", total, skipped);
+  free(line);
+  free(edge);
+  free(frame);
+  return 0;
+}
+
+int decode() {
+  dumpEdge *edge = (dumpEdge*)malloc(frameEdges * sizeof *edge);
+  char *frame = (char*)malloc(sizeof(edgeFrame) + frameMaxBytes(frameEdges));
+  if (edge == NULL || frame == NULL) {
+    perror("decode()");
+    exit(1);
+  }
+
+  size_t len;
+  long total = 0;
+  while ((len = fread(frame, 1, sizeof(edgeFrame), stdin)) == sizeof(edgeFrame)) {
+    if (frameLength(frame, len) < 0) fail("Invalid frame in the edge stream.");
+    size_t bytes = ((edgeFrame*)frame)->bytes;
+    if (fread(frame + len, 1, bytes, stdin) != bytes) fail("Truncated frame in the edge stream.");
+
+    int n = decodeFrame(frame, edge);
+    if (n < 0) fail("Corrupt frame in the edge stream.");
+    for (int i=0; i<n; ++i) printf("%d\t%d\t%s\n", edge[i].from, edge[i].to, edgeTypeName(edge[i].type));
+    total += n;
+  }
+  if (len != 0) fail("Truncated frame in the edge stream.");
+
+  fprintf(stderr, "%ld edges read.\n", total);
+  free(edge);
+  free(frame);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "-d") != 0)) {
+    fprintf(stderr, "Usage: %s [-d] < input > output\n", argv[0]);
+    return 1;
+  }
+  return argc == 2 ? decode() : encode();
+}
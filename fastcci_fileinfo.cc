@@ -1,32 +1,17 @@
-#include <stdio.h>
-#include <stdlib.h>
-#if !defined(__APPLE__)
-#include <malloc.h>
-#endif
-
-int *readFile(const char *fname) {
-  FILE *in = fopen(fname,"rb");
-  fseek(in, 0L, SEEK_END);
-  int sz = ftell(in);
-  fseek(in, 0L, SEEK_SET);
-  int *buf = (int*)malloc(sz);
-  fread(buf, 1, sz, in);
-  return buf;
-}
+#include "fastcci.h"
 
 int main(int argc, char *argv[]) {
   if (argc!=2) exit(1);
   int file = atoi(argv[1]);
 
-  int *cat  = readFile("../fastcci.cat");
-  int *tree = readFile("../fastcci.tree");
+  offset_type *cat;
+  tree_type *tree;
+  readGraph("..", cat, tree);
 
-  int i = cat[file], cstart = i+2, cend = tree[i], cfile = tree[i+1];
-  printf("Found %d subcats tree[%d]=%d %d %d\n", cend-cstart,i, tree[i], tree[i+1], tree[i+2]);
+  offset_type i = cat[file], cend = subcatEnd(tree, i), cfile = fileEnd(tree, i);
+  printf("Found %d subcats tree[%ld]=%d %d %d\n", tree[i], long(i), tree[i], tree[i+1], tree[i+2]);
 
-  for (int j=cend; j<cfile; j++) printf("%d\n",tree[j]);
+  for (offset_type j=cend; j<cfile; j++) printf("%d\n",tree[j]);
 
-  free(cat);
-  free(tree);
   return 0;
 }
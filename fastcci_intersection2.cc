@@ -5,15 +5,7 @@
 #endif
 #include <string.h>
 
-int readFile(const char *fname, int* &buf) {
-  FILE *in = fopen(fname,"rb");
-  fseek(in, 0L, SEEK_END);
-  int sz = ftell(in);
-  fseek(in, 0L, SEEK_SET);
-  buf = (int*)malloc(sz);
-  fread(buf, 1, sz, in);
-  return sz;
-}
+#include "fastcci.h"
 
 const int maxdepth=500;
 
@@ -25,8 +17,8 @@ int *fbuf[2] = {0};
 // list of all subcategory file sets to be merged
 int **kbuf[2] = {0}, kmax[2]={1024*1024,1024*1024}, knum[2];
 
-int *cat; 
-int *tree; 
+offset_type *cat;
+tree_type *tree;
 char *mask;
 
 // recursively traverse the graph an accumulate subcategories
@@ -40,7 +32,7 @@ void fetchFiles(int id, int depth) {
 
   // mark as visited
   mask[id]=1;
-  int c = cat[id], cend = tree[c], cfile = tree[c+1];
+  offset_type c = cat[id], cend = subcatEnd(tree, c), cfile = fileEnd(tree, c);
   c += 2;
   while (c<cend) {
     fetchFiles(tree[c], depth+1);
@@ -63,7 +55,7 @@ void fetchFiles(int id, int depth) {
 }
 
 // comparator for bsearch (TODO: implement own bsearch. Should be faster without the extra function call to the comparator)
-int compare (const void * a, const void * b) {
+int compareAsc (const void * a, const void * b) {
   return ( *(int*)a - *(int*)b );
 }
 
@@ -152,14 +144,11 @@ int main(int argc, char *argv[]) {
   if (argc!=3) exit(1);
   int cid[2] = {atoi(argv[1]), atoi(argv[2])};
 
-  // load the category index with pointers into the tree object
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  // load the category index with pointers into the tree object (file lists are read directly)
+  int maxcat = readGraph("..", cat, tree);
   mask = (char*)malloc(maxcat);
 
   // load the raw subcat/file relation data
-  readFile("../fastcci.tree", tree);
-
   // intermediate return buffers
   kbuf[0]=(int**)malloc(kmax[0] * sizeof *kbuf[0] );
   kbuf[1]=(int**)malloc(kmax[1] * sizeof *kbuf[1] );
@@ -192,11 +181,11 @@ int main(int argc, char *argv[]) {
 
     // heap merge the result set
 
-    //qsort(fbuf[small], fnum[small], sizeof(int), compare);
+    //qsort(fbuf[small], fnum[small], sizeof(int), compareAsc);
 
     int *j0, *j1, r, *j, *end=&(fbuf[small][fnum[small]+1]);
     for (int i=0; i<fnum[large]; ++i) {
-      j = (int*)bsearch((void*)&(fbuf[large][i]), fbuf[small], fnum[small], sizeof(int), compare);
+      j = (int*)bsearch((void*)&(fbuf[large][i]), fbuf[small], fnum[small], sizeof(int), compareAsc);
       if (j) {
         // output the result 
         printf("%d\n",fbuf[large][i]);
@@ -219,8 +208,8 @@ int main(int argc, char *argv[]) {
   } else {
     // sort both and intersect then
     fprintf(stderr,"using sort strategy.\n");
-    qsort(fbuf[0], fnum[0], sizeof(int), compare);
-    qsort(fbuf[1], fnum[1], sizeof(int), compare);
+    qsort(fbuf[0], fnum[0], sizeof(int), compareAsc);
+    qsort(fbuf[1], fnum[1], sizeof(int), compareAsc);
 
     // perform intersection
     int i0=0, i1=1, r, lr=-1;
@@ -240,8 +229,6 @@ int main(int argc, char *argv[]) {
   }
 #endif 
 
-  free(cat);
-  free(tree);
   free(kbuf[0]);
   free(kbuf[1]);
   free(heap);
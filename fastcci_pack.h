@@ -0,0 +1,190 @@
+// packed file lists. In a packed tree (dbPacked flag) the file list of every category
+// block begins with a header word (number of files << 1 | packed flag). Unpacked lists
+// follow as plain ids. Packed lists store the first (largest) id and then groups of up
+// to packGroup gaps between consecutive ids (minus one). A group is a bit width word
+// followed by packLanes interleaved lanes of bit packed gaps, gap k of a group is in row
+// k/packLanes of lane k%packLanes, so that one vector load fetches the same word of all
+// lanes.
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// packed trees of the old layout have treeMagic and treeVersion after the dummy category
+const tree_type treeMagic = 0x5a434346; // "FCCZ"
+const tree_type treeVersion = 2;
+const int packLanes = 8, packRows = 32, packGroup = packLanes * packRows;
+
+// does the tree file (of n entries) contain packed file lists?
+inline bool treePacked(const tree_type *tree, size_t n) {
+  return n >= 4 && tree[2] == treeMagic && tree[3] == treeVersion;
+}
+
+inline int packWidth(uint32_t max) {
+  return max ? 32 - __builtin_clz(max) : 0;
+}
+
+// number of words of the packed encoding of the n ids (descending and unique), or -1
+int packedSize(const tree_type *ids, int n) {
+  int words = 2;
+  for (int g=1; g<n; g+=packGroup) {
+    int m = n-g < packGroup ? n-g : packGroup;
+    uint32_t max = 0;
+    for (int k=g; k<g+m; ++k) {
+      if (ids[k] >= ids[k-1]) return -1;
+      uint32_t v = ids[k-1] - ids[k] - 1;
+      if (v > max) max = v;
+    }
+    int rows = (m + packLanes-1) / packLanes;
+    words += 1 + packLanes * ((rows * packWidth(max) + 31) >> 5);
+  }
+  return words;
+}
+
+// write the file list of n ids (sorted descending) to out (at most n+1 words), the
+// list is packed if that is shorter. Returns the number of words written.
+int packFiles(const tree_type *ids, int n, tree_type *out) {
+  if (n == 0) return 0;
+
+  int size = packedSize(ids, n);
+  if (size < 0 || size >= n+1) {
+    out[0] = n << 1;
+    memcpy(&(out[1]), ids, n * sizeof *ids);
+    return n+1;
+  }
+
+  out[0] = (n << 1) | 1;
+  out[1] = ids[0];
+  tree_type *p = &(out[2]);
+  for (int g=1; g<n; g+=packGroup) {
+    int m = n-g < packGroup ? n-g : packGroup;
+    uint32_t max = 0;
+    for (int k=g; k<g+m; ++k)
+      if (uint32_t(ids[k-1] - ids[k] - 1) > max) max = ids[k-1] - ids[k] - 1;
+
+    int b = packWidth(max), rows = (m + packLanes-1) / packLanes, words = (rows * b + 31) >> 5;
+    *p++ = b;
+    uint32_t *w = (uint32_t*)p;
+    memset(w, 0, packLanes * words * sizeof *w);
+    for (int e=0; e<m; ++e) {
+      uint32_t v = ids[g+e-1] - ids[g+e] - 1;
+      int off = (e / packLanes) * b, l = e % packLanes, k = off >> 5, s = off & 31;
+      w[k*packLanes + l] |= v << s;
+      if (s + b > 32) w[(k+1)*packLanes + l] |= v >> (32-s);
+    }
+    p += packLanes * words;
+  }
+  return size;
+}
+
+// number of files in the file list tree[cend] to tree[cfile-1]
+inline int fileCount(const tree_type *tree, offset_type cend, offset_type cfile, bool packed) {
+  return (packed && cend < cfile) ? tree[cend] >> 1 : cfile - cend;
+}
+
+// decode a group of m gaps following the id last into out (whole rows are written)
+const tree_type *unpackGroupScalar(const tree_type *p, int m, tree_type last, tree_type *out) {
+  int b = *p++, rows = (m + packLanes-1) / packLanes;
+  if (b == 0) {
+    for (int e=0; e<m; ++e) out[e] = --last;
+    return p;
+  }
+
+  const uint32_t *w = (const uint32_t*)p, mask = b == 32 ? ~0u : (1u << b) - 1;
+  for (int j=0; j<rows; ++j) {
+    int off = j * b, k = off >> 5, s = off & 31;
+    for (int l=0; l<packLanes; ++l) {
+      uint32_t v = w[k*packLanes + l] >> s;
+      if (s + b > 32) v |= w[(k+1)*packLanes + l] << (32-s);
+      last -= (v & mask) + 1;
+      out[j*packLanes + l] = last;
+    }
+  }
+  return p + packLanes * ((rows * b + 31) >> 5);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) const tree_type *unpackGroupAVX2(const tree_type *p, int m, tree_type last, tree_type *out) {
+  int b = *p, rows = (m + packLanes-1) / packLanes;
+  if (b == 0) return unpackGroupScalar(p, m, last, out);
+  p++;
+
+  const __m256i mask = _mm256_set1_epi32(b == 32 ? ~0u : (1u << b) - 1);
+  const __m256i one = _mm256_set1_epi32(1), carry = _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3);
+  const __m256i high = _mm256_setr_epi32(0, 0, 0, 0, -1, -1, -1, -1);
+  __m256i base = _mm256_set1_epi32(last);
+  for (int j=0; j<rows; ++j) {
+    int off = j * b, k = off >> 5, s = off & 31;
+    __m256i v = _mm256_srl_epi32(_mm256_loadu_si256((const __m256i*)(p + k*packLanes)), _mm_cvtsi32_si128(s));
+    if (s + b > 32)
+      v = _mm256_or_si256(v, _mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)(p + (k+1)*packLanes)), _mm_cvtsi32_si128(32-s)));
+    v = _mm256_add_epi32(_mm256_and_si256(v, mask), one);
+
+    // prefix sum of the eight gaps
+    v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+    v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+    v = _mm256_add_epi32(v, _mm256_and_si256(_mm256_permutevar8x32_epi32(v, carry), high));
+
+    v = _mm256_sub_epi32(base, v);
+    _mm256_storeu_si256((__m256i*)(out + j*packLanes), v);
+    base = _mm256_permutevar8x32_epi32(v, _mm256_set1_epi32(7));
+  }
+  return p + packLanes * ((rows * b + 31) >> 5);
+}
+#endif
+
+const tree_type *unpackGroup(const tree_type *p, int m, tree_type last, tree_type *out) {
+#if defined(__x86_64__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) return unpackGroupAVX2(p, m, last, out);
+#endif
+  return unpackGroupScalar(p, m, last, out);
+}
+
+// reader for the file list of a category block, unpacked lists are returned in place
+// and packed lists are decoded one group at a time
+struct fileReader {
+  const tree_type *p;
+  int left;
+  bool packed, first;
+  tree_type last;
+  tree_type buf[packGroup + packLanes];
+};
+
+void fileReaderInit(fileReader &fr, const tree_type *tree, offset_type cend, offset_type cfile, bool packed) {
+  fr.p = &(tree[cend]);
+  fr.first = true;
+  fr.packed = false;
+  fr.left = cfile - cend;
+  if (packed && cend < cfile) {
+    fr.packed = *fr.p & 1;
+    fr.left = *fr.p++ >> 1;
+  }
+}
+
+// point ids to the next chunk of files and return its length (0 at the end of the list)
+int fileReaderNext(fileReader &fr, const tree_type* &ids) {
+  int n = 0;
+  if (!fr.packed) {
+    ids = fr.p;
+    n = fr.left;
+    fr.p += n;
+    fr.left = 0;
+    return n;
+  }
+
+  if (fr.first && fr.left > 0) {
+    fr.buf[n++] = fr.last = *fr.p++;
+    fr.left--;
+    fr.first = false;
+  }
+  if (fr.left > 0) {
+    int m = fr.left < packGroup ? fr.left : packGroup;
+    fr.p = unpackGroup(fr.p, m, fr.last, &(fr.buf[n]));
+    n += m;
+    fr.left -= m;
+    fr.last = fr.buf[n-1];
+  }
+  ids = fr.buf;
+  return n;
+}
@@ -12,20 +12,17 @@
 #endif
 #include <string.h>
 
-int readFile(const char *fname, int* &buf) {
-  FILE *in = fopen(fname,"rb");
-  fseek(in, 0L, SEEK_END);
-  int sz = ftell(in);
-  fseek(in, 0L, SEEK_SET);
-  buf = (int*)malloc(sz);
-  fread(buf, 1, sz, in);
-  return sz;
-}
+#include "fastcci.h"
 
 const int maxdepth=300;
 int history[maxdepth];
-int *cat, cat1, cat2; 
-int *tree; 
+offset_type *cat;
+int cat1, cat2;
+tree_type *tree;
+
+// subcategory index
+offset_type *scat;
+tree_type *stree;
 char *mask;
 bool found = false;
 
@@ -47,10 +44,9 @@ void tagCat(int id, int depth) {
 
   // mark as visited
   mask[id]=1;
-  int c = cat[id], cend = tree[c];
-  c += 2;
+  offset_type c = scat[id], cend = scat[id+1];
   while (c<cend) {
-    tagCat(tree[c], depth+1);
+    tagCat(stree[c], depth+1);
     c++; 
   }
 }
@@ -60,18 +56,15 @@ int main(int argc, char *argv[]) {
   cat1 = atoi(argv[1]);
   cat2 = atoi(argv[2]);
 
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
+  int nscat = readSubcats("..", cat, maxcat, tree, scat, stree);
   mask = (char*)malloc(maxcat);
 
-  readFile("../fastcci.tree", tree);
-
   memset(mask,0,maxcat);
-  tagCat(cat1,0); 
+  if (cat1>=0 && cat1<nscat) tagCat(cat1,0); 
 
   if (!found) printf("No connection found.\n");
 
-  free(cat);
-  free(tree);
   return 0;
 }
@@ -11,29 +11,19 @@ int main(int argc, char *argv[]) {
   if (argc!=4) exit(1);
 
   int P = atoi(argv[1]);
-  int F = atoi(argv[1]);
-  int S = atoi(argv[1]);
-
-  int *cat;
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  int F = atoi(argv[2]);
+  int S = atoi(argv[3]);
 
+  offset_type *cat;
   tree_type *tree;
-  readFile("../fastcci.tree", tree);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
 
-  // parent category counter
-  int *pcc = (int*)malloc(maxcat * sizeof(int));
-  memset(pcc, 0, maxcat * sizeof(*pcc));
-
-  // go over all cats and increment pcc for the subcats
-  printf("Counting each categorie's parents...\n");
-  for (int v=0; v<maxcat; ++v)
-    if (cat[v]>-1)
-    {
-      int i = cat[v], cstart = i+2, cend = tree[i];
-      // increase parent cat counter
-      for (int j=cstart; j<cend; ++j) pcc[tree[j]]++;
-    }
+  // reverse index (parents of page v are rtree[rcat[v]] to rtree[rcat[v+1]-1])
+  dbTable rcatfile;
+  if (!dbLoad("../fastcci.rcat", DB_RCAT, rcatfile)) exit(1);
+  offset_type *rcat = (offset_type*)rcatfile.data;
+  int maxrcat = rcatfile.count - 1;
 
   // go over all cats and compare pcc, file count, and subcat count
   printf("Matching...\n");
@@ -41,12 +31,14 @@ int main(int argc, char *argv[]) {
   for (int v=0; v<maxcat; ++v)
     if (cat[v]>-1)
     {
-      int i = cat[v], cstart = i+2, cend = tree[i], cfile = tree[i+1];
+      offset_type i = cat[v];
       // counters
-      int nfile = cfile - cend;
-      int scc   = cend - cstart;
+      int nfile = fileCount(tree, subcatEnd(tree, i), fileEnd(tree, i), packed);
+      int scc   = tree[i];
+
+      int pcc   = v<maxrcat ? rcat[v+1] - rcat[v] : 0;
 
-      if (pcc[v]==P && nfile==F && scc==S) {
+      if (pcc==P && nfile==F && scc==S) {
         nummatch++;
         printf("%d|", v);
       }
@@ -54,7 +46,6 @@ int main(int argc, char *argv[]) {
 
   printf("\n%d matches found.\n", nummatch);
 
-  free(cat);
-  free(tree);
+  dbRelease(rcatfile);
   return 0;
 }
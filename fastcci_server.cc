@@ -1,38 +1,239 @@
 #include <time.h>
 #include "fastcci.h"
+#include "fastcci_bitmap.h"
+#include "fastcci_simd.h"
 #include <sys/stat.h>
+#include <getopt.h>
 
 // thread management objects
 pthread_mutex_t handlerMutex = PTHREAD_MUTEX_INITIALIZER;
+// held by a request handler from claiming a queue slot until the item is appended
+pthread_mutex_t enqueueMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t condition = PTHREAD_COND_INITIALIZER;
 
-// category data and traversal information
 const int maxdepth = 500;
-int maxcat;
-tree_type *cat, *tree, *parent;
 
-// modification time of the tree database file
-time_t treetime;
+// a loaded database snapshot. Queries pin the snapshot they were validated against,
+// so that a reloaded database can replace it while they are still running.
+struct resultList;
+struct database
+{
+  // category data and traversal information
+  int maxcat;
+  offset_type *cat;
+  tree_type *tree;
+
+  // optional reverse (child to parent) index, the parents of page id i are
+  // rtree[rcat[i]] to rtree[rcat[i+1]-1] (maxrcat is the number of page ids covered)
+  int maxrcat;
+  offset_type *rcat;
+  tree_type *rtree;
+
+  // optional subcategory index (the category graph without file lists), the subcategories
+  // of category i < maxscat are stree[scat[i]] to stree[scat[i+1]-1]
+  int maxscat;
+  offset_type *scat;
+  tree_type *stree;
+
+  // dense ids (pageids is NULL for databases numbered by page id): the page id of every
+  // id, the ids of the base files sorted by page id (norder entries), and the ids added by
+  // live updates sorted by page id (newids[0] holds their number). Updates replace newids,
+  // the previous arrays are kept in retired until the snapshot is released.
+  tree_type *pageids, *idorder, *newids;
+  int norder;
+  tree_type **retired;
+  int nretired;
+
+  // mapped database files
+  dbTable catfile, treefile, rcatfile, rtreefile, scatfile, streefile, idsfile, idorderfile;
+
+  // the file lists of the category blocks are packed (see fastcci_pack.h)
+  bool packed;
+
+  // live updates: cat and tree are private mappings with room for catfile.capacity and
+  // treefile.capacity entries. Changed category blocks are appended to tree after the
+  // treebase entries read from the file (treenum entries are in use), and the reverse
+  // and subcategory indices are disabled once the graph no longer matches them.
+  size_t treebase, treenum;
+  bool reverse, subcats;
+  long deltas;
+
+  // modification times of the tree database file and the done marker
+  time_t treetime, donetime;
+
+  // seconds spent loading the files (including prefaulting, locking, and huge page copies)
+  double loadtime;
+
+  // precomputed union of featured/quality/valued images
+  resultList * goodImages;
+
+  // reload counter (cache entries are only valid for the generation they were computed in)
+  unsigned int generation;
+
+  // number of holders (the current snapshot holds one reference on itself)
+  int refs;
+};
+
+// current snapshot
+database * current = NULL;
+pthread_mutex_t databaseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// snapshot used by the calling thread, with its fields copied into thread locals
+__thread database * db = NULL;
+__thread int maxcat = 0;
+__thread offset_type *cat = NULL;
+__thread tree_type *tree = NULL;
+__thread bool packed = false;
+__thread int maxrcat = 0;
+__thread offset_type *rcat = NULL;
+__thread tree_type *rtree = NULL;
+__thread int maxscat = 0;
+__thread offset_type *scat = NULL;
+__thread tree_type *stree = NULL;
+__thread tree_type *pageids = NULL;
+__thread time_t treetime = 0;
+
+void useDatabase(database * d);
+
+// visitation mask. Each entry carries the epoch it was written in (high byte)
+// next to its value (low byte, 0 means unvisited), so that clearing the mask
+// only advances the epoch. The buffer is zeroed once every 255 clears.
+typedef uint16_t mask_type;
+struct visitMask
+{
+  mask_type * m;
+  mask_type stamp; // current epoch shifted into the high byte
+  int size;
+
+  visitMask() : m(NULL), size(0) { resize(maxcat); }
+  ~visitMask() { tableFree(m, (size + 1) * sizeof *m); }
+
+  // reallocate the (cleared) buffer for n entries (huge page backed if configured)
+  void resize(int n)
+  {
+    tableFree(m, (size + 1) * sizeof *m);
+    size = n;
+    stamp = 1 << 8;
+
+    // one padding entry for 32 bit gathers of the last entry
+    if ((m = (mask_type *)tableAlloc((size + 1) * sizeof *m)) == NULL)
+    {
+      perror("visitMask()");
+      exit(1);
+    }
+  }
+
+  // value of entry i in the current epoch
+  unsigned char operator[](int i) const
+  {
+    unsigned int v = m[i] ^ stamp;
+    return v < 256 ? v : 0;
+  }
+
+  // set entry i to f (f must be non-zero)
+  void set(int i, unsigned char f) { m[i] = stamp | f; }
+
+  // atomically set entry i to f if it is unvisited in the current epoch
+  bool claim(int i, unsigned char f)
+  {
+    mask_type v = m[i];
+    if ((v & 0xFF00) == stamp)
+      return false;
+    return __sync_bool_compare_and_swap(&(m[i]), v, mask_type(stamp | f));
+  }
+
+  // start a new epoch (zero the buffer on wraparound)
+  void clear()
+  {
+    if (stamp == (255 << 8))
+    {
+      memset(m, 0, size * sizeof *m);
+      stamp = 1 << 8;
+    }
+    else
+      stamp += 1 << 8;
+  }
+};
+
+// growable item buffer
+struct levelBuffer
+{
+  int max, num;
+  result_type * buf;
+};
+void
+lbGrow(levelBuffer & lb, int len)
+{
+  if (lb.num + len > lb.max)
+  {
+    while (lb.num + len > lb.max)
+      lb.max *= 2;
+    if ((lb.buf = (result_type *)realloc(lb.buf, lb.max * sizeof *(lb.buf))) == NULL)
+    {
+      perror("lbGrow()");
+      exit(1);
+    }
+  }
+}
+
+struct cacheEntry;
 
 // new result data structure
 struct resultList
 {
   int max, num;
   result_type * buf;
-  unsigned char *mask, *tags;
-  resultList(int initialSize = 1024 * 1024) : max(initialSize), num(0), tags(NULL)
+  visitMask mask;
+  unsigned char * tags;
+
+  // categories visited during the traversal
+  levelBuffer cats;
+
+  // cache entry the (read only) buffer is currently borrowed from
+  cacheEntry * cached;
+  result_type * own;
+
+  // serial number of the cache entry holding this result (0 if it is not retained)
+  unsigned int serial;
+
+  // membership is looked up in the compressed bitmaps of the cache entry instead of the mask
+  bool bitmapped;
+
+  resultList(int initialSize = 1024 * 1024)
+      : max(initialSize), num(0), tags(NULL), cached(NULL), serial(0), bitmapped(false)
   {
     buf = (result_type *)malloc(max * sizeof *buf);
-    mask = (unsigned char *)malloc(maxcat * sizeof *mask);
     printf("mask size = %d\n", maxcat);
 
-    if (buf == NULL || mask == NULL)
+    cats.max = 1024;
+    cats.num = 0;
+    cats.buf = (result_type *)malloc(cats.max * sizeof *(cats.buf));
+
+    if (buf == NULL || cats.buf == NULL)
     {
       perror("resultList()");
       exit(1);
     }
   }
+  ~resultList()
+  {
+    free(cached ? own : buf);
+    free(tags);
+    free(cats.buf);
+  }
+
+
+  // mark category i as visited
+  void addCat(int i)
+  {
+    if (mask[i] != 1)
+    {
+      mask.set(i, 1);
+      lbGrow(cats, 1);
+      cats.buf[cats.num++] = i;
+    }
+  }
 
   // pointer to element after the last result
   result_type * tail() const { return &(buf[num]); }
@@ -67,7 +268,22 @@ struct resultList
   }
 
   // clear mask
-  void clear() { memset(mask, 0, maxcat * sizeof *mask); }
+  void clear()
+  {
+    mask.clear();
+    cats.num = 0;
+  }
+
+  // use the buffer of a cache entry (and its bitmaps for mask lookups if probed is set)
+  void attach(cacheEntry * e, bool probed);
+  // return the borrowed buffer to the cache
+  void detach();
+  // upper bound for the number of ids flagged in the mask (files and visited categories)
+  int flagged() const;
+
+  // mask value of id r (0 if not flagged, otherwise depth + 1 or 1 for visited categories)
+  unsigned char probe(result_type r) const { return bitmapped ? probeCached(r) : mask[r]; }
+  unsigned char probeCached(result_type r) const;
 
   // tags list for special union groups (to identify FP/QI/VI for example)
   void addTags()
@@ -79,20 +295,568 @@ struct resultList
     }
   }
 
+  // tag of file r (0 for files added after the tags were allocated)
+  unsigned char tag(result_type r) const { return r < mask.size ? tags[r] : 0; }
+
   // sort result list (unused for output)
   void sort() { qsort(buf, num, sizeof *buf, compare); }
 };
 
-resultList *result[2], *goodImages;
+__thread resultList * goodImages = NULL;
+
+// make d the snapshot of the calling thread
+void
+useDatabase(database * d)
+{
+  db = d;
+  maxcat = d->maxcat;
+  cat = d->cat;
+  tree = d->tree;
+  packed = d->packed;
+  maxrcat = d->reverse ? d->maxrcat : 0;
+  rcat = d->reverse ? d->rcat : NULL;
+  rtree = d->reverse ? d->rtree : NULL;
+  maxscat = d->subcats ? d->maxscat : 0;
+  scat = d->scat;
+  stree = d->stree;
+  pageids = d->pageids;
+  treetime = d->treetime;
+  goodImages = d->goodImages;
+}
+
+// pin snapshot d (the current one by default)
+database *
+acquireDatabase(database * d = NULL)
+{
+  pthread_mutex_lock(&databaseMutex);
+  if (d == NULL)
+    d = current;
+  d->refs++;
+  pthread_mutex_unlock(&databaseMutex);
+  return d;
+}
+
+// unpin a snapshot (it is unmapped once the last holder is gone)
+void
+releaseDatabase(database * d)
+{
+  pthread_mutex_lock(&databaseMutex);
+  bool last = (--d->refs == 0);
+  pthread_mutex_unlock(&databaseMutex);
+  if (!last)
+    return;
+
+  fprintf(stderr, "Releasing database generation %u.\n", d->generation);
+  dbRelease(d->catfile);
+  dbRelease(d->treefile);
+  dbRelease(d->rcatfile);
+  dbRelease(d->rtreefile);
+  dbRelease(d->scatfile);
+  dbRelease(d->streefile);
+  dbRelease(d->idsfile);
+  dbRelease(d->idorderfile);
+  free(d->newids);
+  for (int j = 0; j < d->nretired; ++j)
+    free(d->retired[j]);
+  free(d->retired);
+  delete d->goodImages;
+  delete d;
+}
+
+// cached traversal result (files and visited categories) for a (category, depth) pair
+struct cacheEntry
+{
+  int cid, depth;
+  unsigned int serial;
+  result_type *buf, *cats;
+  int num, ncats;
+  size_t bytes;
+
+  // number of result lists currently borrowing this entry
+  int refs;
+  // removed from the cache while in use (free on release)
+  bool evicted;
+
+  // compressed copies of the ids: the items (to count matches against another cached
+  // result), and all ids flagged in the mask with their mask values in rank order (to
+  // probe cached results without restoring the mask). They are built the first time
+  // they are needed (see resultCache::bitmaps).
+  bitmap items, flagged;
+  unsigned char * values;
+  bool hasBitmaps;
+  pthread_mutex_t bmmutex;
+
+  // LRU list and hash chain
+  cacheEntry *prev, *next, *hnext;
+};
+
+int
+compareU32(const void * a, const void * b)
+{
+  uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+int
+compareU64(const void * a, const void * b)
+{
+  uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// build the compressed bitmaps of a cache entry (ids outside the mask are left out),
+// returns their size in bytes
+size_t
+buildBitmaps(cacheEntry * e)
+{
+  uint32_t * ids = (uint32_t *)malloc(e->num * sizeof *ids + 1);
+  uint64_t * flag = (uint64_t *)malloc((e->num + e->ncats) * sizeof *flag + 1);
+  if (ids == NULL || flag == NULL)
+  {
+    perror("buildBitmaps()");
+    exit(1);
+  }
+
+  // items (ids are unique in a result)
+  int n = 0, m = 0;
+  result_type r;
+  for (int j = 0; j < e->num; ++j)
+    if ((r = e->buf[j] & cat_mask) < maxcat)
+      ids[n++] = r;
+  qsort(ids, n, sizeof *ids, compareU32);
+  bmFromSorted(e->items, ids, n);
+
+  // flagged ids with their mask value in the low byte (1 for visited categories, depth + 1
+  // for items), the lowest value of each id is kept
+  for (int j = 0; j < e->num; ++j)
+    if ((r = e->buf[j] & cat_mask) < maxcat)
+    {
+      int d = (e->buf[j] & depth_mask) >> depth_shift;
+      flag[m++] = (uint64_t(r) << 8) | (d < 254 ? d + 1 : 255);
+    }
+  for (int j = 0; j < e->ncats; ++j)
+    flag[m++] = (uint64_t(e->cats[j]) << 8) | 1;
+  qsort(flag, m, sizeof *flag, compareU64);
+  if ((ids = (uint32_t *)realloc(ids, m * sizeof *ids + 1)) == NULL ||
+      (e->values = (unsigned char *)malloc(m + 1)) == NULL)
+  {
+    perror("buildBitmaps()");
+    exit(1);
+  }
+  n = 0;
+  for (int j = 0; j < m; ++j)
+    if (n == 0 || ids[n - 1] != (flag[j] >> 8))
+    {
+      ids[n] = flag[j] >> 8;
+      e->values[n++] = flag[j] & 0xFF;
+    }
+  bmFromSorted(e->flagged, ids, n);
+
+  free(ids);
+  free(flag);
+  return bmBytes(e->items) + bmBytes(e->flagged) + n;
+}
+
+// size bounded LRU cache of traversal results
+struct resultCache
+{
+  pthread_mutex_t mutex;
+  size_t maxbytes, bytes;
+  int nentries;
+  long hits, misses;
+
+  // serial number of the next inserted entry (cursors refer to entries by serial)
+  unsigned int nextSerial;
+
+  // database generation of the cached results
+  unsigned int generation;
+
+  // hash table and LRU list (head is the most recently used entry)
+  static const int tablesize = 4096;
+  cacheEntry * table[tablesize];
+  cacheEntry *head, *tail;
+
+  resultCache(size_t max) : maxbytes(max), bytes(0), nentries(0), hits(0), misses(0), nextSerial(1), generation(0), head(NULL), tail(NULL)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    memset(table, 0, sizeof table);
+  }
+
+  static int hash(int cid, int depth) { return (unsigned(cid) * 31u + unsigned(depth)) & (tablesize - 1); }
+
+  void unlink(cacheEntry * e)
+  {
+    if (e->prev)
+      e->prev->next = e->next;
+    else
+      head = e->next;
+    if (e->next)
+      e->next->prev = e->prev;
+    else
+      tail = e->prev;
+  }
+
+  void pushFront(cacheEntry * e)
+  {
+    e->prev = NULL;
+    e->next = head;
+    if (head)
+      head->prev = e;
+    head = e;
+    if (tail == NULL)
+      tail = e;
+  }
+
+  static void destroy(cacheEntry * e)
+  {
+    bmFree(e->items);
+    bmFree(e->flagged);
+    free(e->values);
+    pthread_mutex_destroy(&(e->bmmutex));
+    free(e->buf);
+    free(e->cats);
+    delete e;
+  }
+
+  // remove an entry from the cache (it is freed once no result list borrows it anymore)
+  void evict(cacheEntry * e)
+  {
+    cacheEntry ** h = &(table[hash(e->cid, e->depth)]);
+    while (*h != e)
+      h = &((*h)->hnext);
+    *h = e->hnext;
+    unlink(e);
+    bytes -= e->bytes;
+    nentries--;
+
+    if (e->refs == 0)
+      destroy(e);
+    else
+      e->evicted = true;
+  }
+
+  // find an entry and pin it (returns NULL on a miss or for queries that started on
+  // another database generation g)
+  cacheEntry * lookup(int cid, int depth, unsigned int g)
+  {
+    pthread_mutex_lock(&mutex);
+    cacheEntry * e = g == generation ? table[hash(cid, depth)] : NULL;
+    while (e && (e->cid != cid || e->depth != depth))
+      e = e->hnext;
+
+    if (e)
+    {
+      hits++;
+      e->refs++;
+      unlink(e);
+      pushFront(e);
+    }
+    else
+      misses++;
+    pthread_mutex_unlock(&mutex);
+    return e;
+  }
+
+  // build the bitmaps of a pinned entry if it has none yet
+  void bitmaps(cacheEntry * e)
+  {
+    pthread_mutex_lock(&(e->bmmutex));
+    if (!e->hasBitmaps)
+    {
+      size_t b = buildBitmaps(e);
+      pthread_mutex_lock(&mutex);
+      e->bytes += b;
+      if (!e->evicted)
+      {
+        bytes += b;
+        while (tail && tail != e && bytes > maxbytes)
+          evict(tail);
+      }
+      pthread_mutex_unlock(&mutex);
+      e->hasBitmaps = true;
+    }
+    pthread_mutex_unlock(&(e->bmmutex));
+  }
+
+  // unpin an entry
+  void release(cacheEntry * e)
+  {
+    pthread_mutex_lock(&mutex);
+    if (--e->refs == 0 && e->evicted)
+      destroy(e);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // store a copy of a traversal result computed on database generation g and return its
+  // serial number (results larger than half the cache or of a previous generation are not
+  // stored and 0 is returned)
+  unsigned int insert(int cid, int depth, unsigned int g, resultList * r)
+  {
+    size_t b = sizeof(cacheEntry) + (r->num + r->cats.num) * sizeof(result_type);
+    if (b > maxbytes / 2 || g != generation)
+      return 0;
+
+    cacheEntry * e = new cacheEntry;
+    e->cid = cid;
+    e->depth = depth;
+    e->num = r->num;
+    e->ncats = r->cats.num;
+    e->bytes = b;
+    e->refs = 0;
+    e->evicted = false;
+    bmInit(e->items);
+    bmInit(e->flagged);
+    e->values = NULL;
+    e->hasBitmaps = false;
+    pthread_mutex_init(&(e->bmmutex), NULL);
+    e->buf = (result_type *)malloc(e->num * sizeof *(e->buf) + 1);
+    e->cats = (result_type *)malloc(e->ncats * sizeof *(e->cats) + 1);
+    if (e->buf == NULL || e->cats == NULL)
+    {
+      perror("resultCache->insert()");
+      exit(1);
+    }
+    memcpy(e->buf, r->buf, e->num * sizeof *(e->buf));
+    memcpy(e->cats, r->cats.buf, e->ncats * sizeof *(e->cats));
+
+    pthread_mutex_lock(&mutex);
+
+    // the database changed while the result was computed
+    if (g != generation)
+    {
+      pthread_mutex_unlock(&mutex);
+      destroy(e);
+      return 0;
+    }
+
+    // another worker might have inserted the same result in the meantime
+    cacheEntry * o = table[hash(cid, depth)];
+    while (o && (o->cid != cid || o->depth != depth))
+      o = o->hnext;
+    if (o)
+      evict(o);
+
+    // make room
+    while (tail && bytes + e->bytes > maxbytes)
+      evict(tail);
+
+    // skip 0 on wraparound
+    if (nextSerial == 0)
+      nextSerial++;
+    e->serial = nextSerial++;
+
+    int h = hash(cid, depth);
+    e->hnext = table[h];
+    table[h] = e;
+    pushFront(e);
+    bytes += e->bytes;
+    nentries++;
+
+    unsigned int serial = e->serial;
+    pthread_mutex_unlock(&mutex);
+    return serial;
+  }
+
+  // drop all entries (the database changed to generation g)
+  void invalidate(unsigned int g)
+  {
+    pthread_mutex_lock(&mutex);
+    generation = g;
+    while (tail)
+      evict(tail);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // advance the generation of snapshot d after it was patched in place and drop all
+  // entries in the same step (so no result computed before the change is stored after it)
+  void advance(database * d)
+  {
+    pthread_mutex_lock(&mutex);
+    generation = __sync_add_and_fetch(&(d->generation), 1);
+    while (tail)
+      evict(tail);
+    pthread_mutex_unlock(&mutex);
+  }
+};
+resultCache * cache = NULL;
+
+void
+resultList::attach(cacheEntry * e, bool probed)
+{
+  own = buf;
+  cached = e;
+  buf = e->buf;
+  num = e->num;
+  serial = e->serial;
+
+  // the mask stays empty, lookups go to the bitmaps
+  bitmapped = probed;
+  if (probed)
+  {
+    cache->bitmaps(e);
+    clear();
+  }
+}
+
+unsigned char
+resultList::probeCached(result_type r) const
+{
+  int k = bmRank(cached->flagged, r);
+  return k < 0 ? 0 : cached->values[k];
+}
+
+int
+resultList::flagged() const
+{
+  return num + (cached ? cached->ncats : cats.num);
+}
+
+void
+resultList::detach()
+{
+  if (cached == NULL)
+    return;
+
+  cache->release(cached);
+  cached = NULL;
+  bitmapped = false;
+  buf = own;
+  num = 0;
+}
+
+// buffering of up to 50 search results (the amount we can safely API query)
+const int resmaxqueue = 50, resmaxbuf = 64 * resmaxqueue;
+
+// binary results (t=bin) are buffered in frames of up to resmaxbin bytes, the encoded
+// items start after room for the frame header (record length, type, and item count)
+const int resmaxbin = 64 * 1024, resbinhead = 16, resbinitem = 10, resbintagbits = 3;
+
+// per compute worker traversal state (the mmapped cat/tree data is shared)
+struct traversalTeam;
+struct workerContext
+{
+  pthread_t thread;
+  int id;
+
+  // threads that expand large traversal levels in parallel (NULL for serial traversals)
+  traversalTeam * team;
+
+  // intermediate result lists for c1 and c2
+  resultList * result[2];
+
+  // breadth first search ringbuffer
+  ringBuffer rb;
+
+  // parent category buffer and path history for shortest path finding
+  tree_type * parent;
+  result_type history[maxdepth];
+
+  // result output buffers (text and binary)
+  char rescombuf[resmaxbuf];
+  int resnumqueue, residx;
+  unsigned char resbin[resmaxbin];
+  int binidx;
+  tree_type binlast;
+  bool resbroken; // a write to the client failed
+
+  // export output buffer (allocated on first use)
+  char * expbuf;
+
+  // number of page ids the masks and the parent buffer are allocated for
+  int capacity;
+
+  workerContext(int i) : id(i), team(NULL), resnumqueue(0), residx(0), binidx(resbinhead), binlast(0), resbroken(false), expbuf(NULL), capacity(maxcat)
+  {
+    result[0] = new resultList(1024 * 1024);
+    result[1] = new resultList(1024 * 1024);
+    rbInit(rb);
+
+    if ((parent = (tree_type *)malloc(maxcat * sizeof *parent)) == NULL)
+    {
+      perror("parent");
+      exit(1);
+    }
+  }
+
+  // grow the per page id buffers for the database snapshot of the calling thread
+  void fit()
+  {
+    if (maxcat <= capacity)
+      return;
+
+    capacity = maxcat;
+    result[0]->mask.resize(capacity);
+    result[1]->mask.resize(capacity);
+    if ((parent = (tree_type *)realloc(parent, capacity * sizeof *parent)) == NULL)
+    {
+      perror("parent");
+      exit(1);
+    }
+  }
+};
+
+// compute worker pool
+int numWorkers = 1;
+workerContext ** worker;
+
+// query strategies for boolean operations
+enum queryPlan
+{
+  QP_BOTH,   // expand c1 and c2 completely
+  QP_STREAM, // expand c2, stream c1 against it until the output window is full
+  QP_PROBE,  // expand c1, traverse c2 only until all items of c1 are found
+  QP_UPWARD  // expand c1, traverse the c2 categories and check the parents of the c1 files
+};
+const char * planName[] = {"both", "stream", "probe", "upward"};
+long planCount[4] = {0, 0, 0, 0};
 
-// breadth first search ringbuffer
-struct ringBuffer rb;
+// closure size ratio above which the small c1 is expanded and c2 probed,
+// and the number of categories sampled to estimate a closure size
+const long planRatio = 8;
+const int planSample = 1000;
 
 // work item queue
 int aItem = 0, bItem = 0;
 const int maxItem = 1000;
 struct workItem queue[maxItem];
 
+// page id of an id of the database
+inline tree_type
+pageId(tree_type id)
+{
+  return pageids ? pageids[id] : id;
+}
+
+// look up a page id in a list of ids of d sorted by page id (returns the id or -1)
+tree_type
+findPageId(const database * d, const tree_type * list, int n, long pageid)
+{
+  int a = 0, b = n;
+  while (a < b)
+  {
+    int m = (a + b) >> 1;
+    if (d->pageids[list[m]] < pageid)
+      a = m + 1;
+    else
+      b = m;
+  }
+  return (a < n && d->pageids[list[a]] == pageid) ? list[a] : -1;
+}
+
+// id of a page id in snapshot d (databases without dense ids are numbered by page id,
+// -1 for pages that are not in the graph)
+long
+denseId(const database * d, long pageid)
+{
+  if (d->pageids == NULL)
+    return pageid;
+
+  tree_type id = findPageId(d, d->idorder, d->norder, pageid), * added = d->newids;
+  if (id < 0 && added != NULL)
+    id = findPageId(d, added + 1, added[0], pageid);
+  return id;
+}
+
 // check if an ID is a valid category
 inline bool
 isCategory(int i)
@@ -107,10 +871,35 @@ isFile(int i)
   return (i >= 0 && i < maxcat && cat[i] < 0);
 }
 
-// buffering of up to 50 search results (the amount we can safely API query)
-const int resmaxqueue = 50, resmaxbuf = 64 * resmaxqueue;
-char rescombuf[resmaxbuf];
-int resnumqueue = 0, residx = 0;
+// subcategories of category i (from the subcategory index while it matches the graph,
+// so that traversals which only follow subcategories do not touch the file lists)
+inline const tree_type *
+subcatList(tree_type i, int & n)
+{
+  if (i < maxscat)
+  {
+    n = scat[i + 1] - scat[i];
+    return &(stree[scat[i]]);
+  }
+  offset_type c = cat[i];
+  n = tree[c];
+  return &(tree[c + 2]);
+}
+
+// write a record of a binary HTTP response (little endian length, type, and data)
+ssize_t
+resultRecord(int i, char type, const char * data, size_t len)
+{
+  unsigned char head[5];
+  uint32_t n = len + 1;
+  for (int k = 0; k < 4; ++k)
+    head[k] = n >> (8 * k);
+  head[4] = type;
+  if (onion_response_write(queue[i].res, (const char *)head, 5) < 0)
+    return -1;
+  return onion_response_write(queue[i].res, data, len);
+}
+
 ssize_t
 resultPrintf(int i, const char * fmt, ...)
 {
@@ -125,6 +914,10 @@ resultPrintf(int i, const char * fmt, ...)
   onion_response * res = queue[i].res;
   onion_websocket * ws = queue[i].ws;
 
+  // text record of a binary response
+  if (res && queue[i].binary)
+    return resultRecord(i, 'T', buf, strnlen(buf, 4096));
+
   // TODO: use onion_*_write here?
   if (res)
   {
@@ -149,7 +942,9 @@ resultDone(int i)
   onion_websocket * ws = queue[i].ws;
 
   // TODO: use onion_*_write here?
-  if (res)
+  if (res && queue[i].binary)
+    resultRecord(i, 'T', "DONE", 4);
+  else if (res)
   {
     // regular text response
     if (queue[i].connection == WC_XHR)
@@ -166,68 +961,390 @@ resultStart(int i)
   onion_response * res = queue[i].res;
   onion_websocket * ws = queue[i].ws;
   // reset per-request result buffer state
-  resnumqueue = 0;
-  residx = 0;
+  queue[i].ctx->resnumqueue = 0;
+  queue[i].ctx->residx = 0;
+  queue[i].ctx->binidx = resbinhead;
+  queue[i].ctx->binlast = 0;
+  queue[i].ctx->resbroken = false;
 
   if (res && queue[i].connection == WC_JS)
     onion_response_printf(res, "fastcciCallback( [");
   if (queue[i].ws)
     onion_websocket_printf(queue[i].ws, "COMPUTE_START");
 }
+// send the queued binary results as a frame ('R', the number of items, and the items)
+// in a record of an HTTP response or as a binary websocket message
 void
-resultFlush(int i)
+resultFlushBinary(int i)
 {
-  // nothing to flush
-  if (residx == 0)
+  workerContext * ctx = queue[i].ctx;
+  if (ctx->resnumqueue == 0)
     return;
 
-  //
-  onion_response * res = queue[i].res;
-  onion_websocket * ws = queue[i].ws;
-
-  // zero terminate buffer
-  rescombuf[residx - 1] = 0;
+  // write the header in front of the items
+  unsigned char head[resbinhead];
+  head[0] = 'R';
+  int hlen = putVarint(&(head[1]), ctx->resnumqueue) - head;
+  unsigned char * frame = &(ctx->resbin[resbinhead - hlen]);
+  memcpy(frame, head, hlen);
+  int len = ctx->binidx - (resbinhead - hlen);
 
-  // send buffer and reset inices
-  resultPrintf(i, "RESULT %s", rescombuf);
-  resnumqueue = 0;
-  residx = 0;
+  if (queue[i].res)
+  {
+    uint32_t n = len;
+    for (int k = 0; k < 4; ++k)
+      frame[k - 4] = n >> (8 * k);
+    if (onion_response_write(queue[i].res, (const char *)(frame - 4), len + 4) < 0)
+      ctx->resbroken = true;
+  }
+  if (queue[i].ws)
+  {
+    onion_websocket_set_opcode(queue[i].ws, OWS_BINARY);
+    if (onion_websocket_write(queue[i].ws, (const char *)frame, len) < 0)
+      ctx->resbroken = true;
+    onion_websocket_set_opcode(queue[i].ws, OWS_TEXT);
+  }
+
+  ctx->resnumqueue = 0;
+  ctx->binidx = resbinhead;
+  ctx->binlast = 0;
+}
+
+void
+resultFlush(int i)
+{
+  workerContext * ctx = queue[i].ctx;
+  if (queue[i].binary)
+  {
+    resultFlushBinary(i);
+    return;
+  }
+
+  // nothing to flush
+  if (ctx->residx == 0)
+    return;
+
+  //
+  onion_response * res = queue[i].res;
+  onion_websocket * ws = queue[i].ws;
+
+  // zero terminate buffer
+  ctx->rescombuf[ctx->residx - 1] = 0;
+
+  // send buffer and reset inices
+  resultPrintf(i, "RESULT %s", ctx->rescombuf);
+  ctx->resnumqueue = 0;
+  ctx->residx = 0;
+}
+
+// queue a binary item: page id (zigzag coded difference to the previous item of the
+// frame) and depth and tag, frames are only limited by the buffer size
+void
+resultQueueBinary(int i, tree_type pageid, int depth, unsigned char tag)
+{
+  workerContext * ctx = queue[i].ctx;
+  int64_t d = int64_t(pageid) - ctx->binlast;
+  unsigned char * p = &(ctx->resbin[ctx->binidx]);
+  p = putVarint(p, uint64_t((d << 1) ^ (d >> 63)));
+  p = putVarint(p, (uint64_t(depth) << resbintagbits) | tag);
+  ctx->binidx = p - ctx->resbin;
+  ctx->binlast = pageid;
+  ctx->resnumqueue++;
+  if (ctx->binidx + resbinitem > resmaxbin)
+    resultFlushBinary(i);
 }
 
 void
 resultQueue(int i, result_type item, unsigned char tag)
 {
+  workerContext * ctx = queue[i].ctx;
+
+  if (queue[i].binary)
+  {
+    resultQueueBinary(i, pageId(item & cat_mask), (item & depth_mask) >> depth_shift, tag);
+    return;
+  }
+
   // TODO check for truncation (but what then?!)
-  residx += snprintf(&(rescombuf[residx]),
-                     resmaxbuf - residx,
-                     "%d,%d,%d|",
-                     int(item & cat_mask),
-                     int((item & depth_mask) >> depth_shift),
-                     tag);
+  ctx->residx += snprintf(&(ctx->rescombuf[ctx->residx]),
+                          resmaxbuf - ctx->residx,
+                          "%d,%d,%d|",
+                          int(pageId(item & cat_mask)),
+                          int((item & depth_mask) >> depth_shift),
+                          tag);
 
   // queued enough values?
-  if (++resnumqueue == resmaxqueue)
+  if (++ctx->resnumqueue == resmaxqueue)
     resultFlush(i);
 }
 
+// send a cursor to resume the scan of r1 at position pos after n matches (the scan
+// position is only used if r1 is still retained in the cache under its serial)
+void
+resultCursor(int i, resultList * r1, int pos, int n)
+{
+  resultPrintf(i, "CURSOR %x-%d-%d", r1->serial, pos, n);
+}
+
+// team of threads that expands large breadth first search levels of one compute worker
+// in parallel. The threads are started once and wait for the levels handed to them.
+struct teamThreadArg
+{
+  traversalTeam * team;
+  int t;
+};
+// slices of the per thread buffers filled by one chunk of level categories
+struct levelChunk
+{
+  int t, file0, file1, sub0, sub1, cat0, cat1;
+};
+void * teamThread(void * arg);
+struct traversalTeam
+{
+  pthread_mutex_t mutex;
+  int nthreads;
+  pthread_t * threads;
+  teamThreadArg * args;
+
+  // levels handed to the team so far, and the number of team threads still working
+  // on the current one (the calling worker works as thread 0)
+  pthread_cond_t start, done;
+  int round, running;
+
+  // per thread buffers for found files, next level subcategories, and visited categories
+  levelBuffer *files, *subcats, *visited;
+
+  // chunk records (used to merge the per thread buffers in level order)
+  levelChunk * chunks;
+  int maxchunks;
+
+  // current level (and the database snapshot it belongs to)
+  database * db;
+  ringBuffer * rb;
+  resultList * r1;
+  int n, next, depth;
+  result_type d;
+
+  traversalTeam(int t) : nthreads(t), round(0), running(0), chunks(NULL), maxchunks(0)
+  {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&start, NULL);
+    pthread_cond_init(&done, NULL);
+    threads = new pthread_t[nthreads];
+    args = new teamThreadArg[nthreads];
+    files = new levelBuffer[nthreads];
+    subcats = new levelBuffer[nthreads];
+    visited = new levelBuffer[nthreads];
+    for (int j = 0; j < nthreads; ++j)
+    {
+      args[j].team = this;
+      args[j].t = j;
+      files[j].max = subcats[j].max = visited[j].max = 1024;
+      files[j].buf = (result_type *)malloc(files[j].max * sizeof *(files[j].buf));
+      subcats[j].buf = (result_type *)malloc(subcats[j].max * sizeof *(subcats[j].buf));
+      visited[j].buf = (result_type *)malloc(visited[j].max * sizeof *(visited[j].buf));
+      if (files[j].buf == NULL || subcats[j].buf == NULL || visited[j].buf == NULL)
+      {
+        perror("traversalTeam()");
+        exit(1);
+      }
+    }
+    for (int j = 1; j < nthreads; ++j)
+      if (pthread_create(&(threads[j]), NULL, teamThread, &(args[j])))
+      {
+        perror("traversalTeam()");
+        exit(1);
+      }
+  }
+};
+
+// number of threads per traversal team
+int numTraversalThreads = 1;
+
+// minimum number of categories in a level to expand it in parallel
+const int parallelMinLevel = 64;
+// number of level categories a team thread claims at a time
+const int parallelChunk = 16;
+
 //
-// Fetch all files in and below category 'id'
-// in a breadth first search up to depth 'depth'
-// if 'depth' is negative treat it as infinity
+// expand categories of the current level until none are left
+// (visited categories and files are claimed with an atomic test-and-set on the mask)
+//
+void *
+expandLevelThread(void * arg)
+{
+  traversalTeam * tm = ((teamThreadArg *)arg)->team;
+  int t = ((teamThreadArg *)arg)->t;
+  useDatabase(tm->db);
+  levelBuffer & files = tm->files[t];
+  levelBuffer & subcats = tm->subcats[t];
+  levelBuffer & visited = tm->visited[t];
+  ringBuffer & rb = *(tm->rb);
+  visitMask & mask = tm->r1->mask;
+  files.num = subcats.num = visited.num = 0;
+
+  result_type d = tm->d, r, i;
+  result_type e = (d + 1) << depth_shift;
+  unsigned char f = d < 254 ? (d + 1) : 255;
+  bool push = (d < tm->depth || tm->depth < 0);
+  d = d << depth_shift;
+  fileReader fr;
+
+  while (true)
+  {
+    int k = __sync_fetch_and_add(&(tm->next), parallelChunk);
+    if (k >= tm->n)
+      break;
+    int kend = k + parallelChunk < tm->n ? k + parallelChunk : tm->n;
+    levelChunk & chunk = tm->chunks[k / parallelChunk];
+    chunk.t = t;
+    chunk.file0 = files.num;
+    chunk.sub0 = subcats.num;
+    chunk.cat0 = visited.num;
+
+    for (; k < kend; ++k)
+    {
+      i = rb.buf[(rb.a + k) & rb.mask] & cat_mask;
+
+      // claim the category (it might have been queued more than once)
+      if (i >= maxcat || !mask.claim(i, 1))
+        continue;
+      lbGrow(visited, 1);
+      visited.buf[visited.num++] = i;
+
+      offset_type c = cat[i], cend = subcatEnd(tree, c), cfile = fileEnd(tree, c);
+      c += 2;
+
+      // collect unvisited subcats for the next level
+      if (push)
+      {
+        lbGrow(subcats, cend - c);
+        for (; c < cend; ++c)
+          if (tree[c] < maxcat && mask[tree[c]] == 0 && cat[tree[c]] > 0)
+            subcats.buf[subcats.num++] = tree[c] | e;
+      }
+
+      // claim and copy files (and subcats if we are at the maximum depth)
+      const tree_type * ids = &(tree[c]);
+      int n = cend - c;
+      fileReaderInit(fr, tree, cend, cfile, packed);
+      lbGrow(files, n + fr.left);
+      do
+      {
+        for (int j = 0; j < n; ++j)
+        {
+          r = ids[j];
+          if ((r & cat_mask) < maxcat && mask.claim(r & cat_mask, f))
+            files.buf[files.num++] = r | d;
+        }
+      } while ((n = fileReaderNext(fr, ids)) > 0);
+    }
+
+    chunk.file1 = files.num;
+    chunk.sub1 = subcats.num;
+    chunk.cat1 = visited.num;
+  }
+
+  return NULL;
+}
+
+// team thread: expand every level handed to the team
+void *
+teamThread(void * arg)
+{
+  traversalTeam * tm = ((teamThreadArg *)arg)->team;
+  int seen = 0;
+  while (true)
+  {
+    pthread_mutex_lock(&(tm->mutex));
+    while (tm->round == seen)
+      pthread_cond_wait(&(tm->start), &(tm->mutex));
+    seen = tm->round;
+    pthread_mutex_unlock(&(tm->mutex));
+
+    expandLevelThread(arg);
+
+    pthread_mutex_lock(&(tm->mutex));
+    if (--tm->running == 0)
+      pthread_cond_signal(&(tm->done));
+    pthread_mutex_unlock(&(tm->mutex));
+  }
+  return NULL;
+}
+
+//
+// expand the 'n' categories at the head of the ring buffer (all at depth 'd')
+// using the traversal team tm. The files found are appended in chunk order, which
+// keeps the result ordered by depth and (up to files claimed concurrently by
+// several categories of the level) reproduces the order of a serial expansion.
 //
 void
-fetchFiles(tree_type id, int depth, resultList * r1)
+expandLevelParallel(traversalTeam * tm, ringBuffer & rb, int n, result_type d, int depth, resultList * r1)
 {
-  // clear ring buffer
-  rbClear(rb);
+  tm->db = db;
+  tm->rb = &rb;
+  tm->r1 = r1;
+  tm->n = n;
+  tm->next = 0;
+  tm->d = d;
+  tm->depth = depth;
+
+  int nchunks = (n + parallelChunk - 1) / parallelChunk;
+  if (nchunks > tm->maxchunks)
+  {
+    tm->maxchunks = nchunks;
+    if ((tm->chunks = (levelChunk *)realloc(tm->chunks, nchunks * sizeof *(tm->chunks))) == NULL)
+    {
+      perror("expandLevelParallel()");
+      exit(1);
+    }
+  }
 
-  // push root node (depth 0)
-  rbPush(rb, id);
+  // wake the team, the calling thread works as thread 0
+  pthread_mutex_lock(&(tm->mutex));
+  tm->running = tm->nthreads - 1;
+  tm->round++;
+  pthread_cond_broadcast(&(tm->start));
+  pthread_mutex_unlock(&(tm->mutex));
+  expandLevelThread(&(tm->args[0]));
+  pthread_mutex_lock(&(tm->mutex));
+  while (tm->running > 0)
+    pthread_cond_wait(&(tm->done), &(tm->mutex));
+  pthread_mutex_unlock(&(tm->mutex));
+
+  // pop the processed level and merge the per thread buffers
+  rb.a += n;
+  for (int k = 0; k < nchunks; ++k)
+  {
+    levelChunk & chunk = tm->chunks[k];
+    levelBuffer & files = tm->files[chunk.t];
+    int len = chunk.file1 - chunk.file0;
+    r1->grow(len);
+    memcpy(r1->tail(), &(files.buf[chunk.file0]), len * sizeof *(files.buf));
+    r1->num += len;
+
+    levelBuffer & subcats = tm->subcats[chunk.t];
+    for (int j = chunk.sub0; j < chunk.sub1; ++j)
+      rbPush(rb, subcats.buf[j]);
+
+    levelBuffer & visited = tm->visited[chunk.t];
+    len = chunk.cat1 - chunk.cat0;
+    lbGrow(r1->cats, len);
+    memcpy(&(r1->cats.buf[r1->cats.num]), &(visited.buf[chunk.cat0]), len * sizeof *(visited.buf));
+    r1->cats.num += len;
+  }
+}
 
+// expand the n categories of the current level in the ring buffer (serial traversal),
+// without files only the subcategories listed at the depth limit are added as items
+// (and the subcategories are read from the subcategory index)
+void
+expandLevel(ringBuffer & rb, int n, int depth, resultList * r1, bool files = true)
+{
   result_type r, d, e, i;
   unsigned char f;
-  int c, len;
-  while (!rbEmpty(rb))
+  fileReader fr;
+  while (n--)
   {
     r = rbPop(rb);
     d = (r & depth_mask) >> depth_shift;
@@ -235,51 +1352,108 @@ fetchFiles(tree_type id, int depth, resultList * r1)
     if (i >= maxcat) continue;
 
     // tag current category as visited
-    r1->mask[i] = 1;
+    r1->addCat(i);
 
-    int c = cat[i], cend = tree[c], cfile = tree[c + 1];
-    c += 2;
+    offset_type c, cend = 0, cfile = 0;
+    int len;
+    const tree_type * src;
+    if (files)
+    {
+      c = cat[i];
+      cend = subcatEnd(tree, c);
+      cfile = fileEnd(tree, c);
+      len = tree[c];
+      src = &(tree[c + 2]);
+    }
+    else
+      src = subcatList(i, len);
 
     // push all subcats to queue
     if (d < depth || depth < 0)
     {
       e = (d + 1) << depth_shift;
-      while (c < cend)
+      for (; len > 0; --len, ++src)
       {
         // push unvisited categories (that are not empty, cat[id]==0) into the queue
-        if (tree[c] < maxcat && r1->mask[tree[c]] == 0 && cat[tree[c]] > 0)
-          rbPush(rb, tree[c] | e);
-        c++;
+        if (*src < maxcat && r1->mask[*src] == 0 && cat[*src] > 0)
+          rbPush(rb, *src | e);
       }
     }
 
-    // copy and add the depth on top
-    int len = cfile - c;
-    r1->grow(len);
-    result_type *dst = r1->tail(), *old = dst;
-    tree_type * src = &(tree[c]);
+    // copy and add the depth on top (packed file lists are decoded a group at a time)
+    fileReaderInit(fr, tree, cend, cfile, packed);
     f = d < 254 ? (d + 1) : 255;
     d = d << depth_shift;
-    while (len--)
+    do
     {
-      r = (*src++);
-      if ((r & cat_mask) < maxcat && r1->mask[r & cat_mask] == 0)
+      r1->grow(len);
+      result_type *dst = r1->tail(), *old = dst;
+      while (len--)
       {
-        *dst++ = (r | d);
-        r1->mask[r & cat_mask] = f;
+        r = (*src++);
+        if ((r & cat_mask) < maxcat && r1->mask[r & cat_mask] == 0)
+        {
+          *dst++ = (r | d);
+          r1->mask.set(r & cat_mask, f);
+        }
       }
-    }
-    r1->num += dst - old;
+      r1->num += dst - old;
+    } while ((len = fileReaderNext(fr, src)) > 0);
   }
 }
 
+// callback invoked after each completed breadth first search level (return true to stop)
+typedef bool (*levelHook)(void * data);
+
+//
+// Fetch all files in and below category 'id'
+// in a breadth first search up to depth 'depth'
+// if 'depth' is negative treat it as infinity
+// returns false if the traversal was stopped early by the level hook
+//
+bool
+fetchFiles(workerContext * ctx, tree_type id, int depth, resultList * r1, levelHook hook = NULL, void * data = NULL)
+{
+  ringBuffer & rb = ctx->rb;
+
+  // clear ring buffer
+  rbClear(rb);
+
+  // push root node (depth 0)
+  rbPush(rb, id);
+
+  result_type d;
+  while (!rbEmpty(rb))
+  {
+    // all categories currently in the ring buffer belong to the same level
+    int n = rb.b - rb.a;
+
+    // expand large levels with the traversal team of the worker
+    if (ctx->team != NULL && n >= parallelMinLevel)
+    {
+      d = (rb.buf[rb.a & rb.mask] & depth_mask) >> depth_shift;
+      expandLevelParallel(ctx->team, rb, n, d, depth, r1);
+    }
+    else
+      expandLevel(rb, n, depth, r1);
+
+    // the level is complete, the files found so far are in their final order
+    if (hook != NULL && hook(data))
+      return false;
+  }
+
+  return true;
+}
 //
 // iteratively do a breadth first path search
 //
-result_type history[maxdepth];
 void
 tagCat(tree_type sid, int qi, int maxDepth, resultList * r1)
 {
+  ringBuffer & rb = queue[qi].ctx->rb;
+  tree_type * parent = queue[qi].ctx->parent;
+  result_type * history = queue[qi].ctx->history;
+
   // clear ring buffer
   rbClear(rb);
 
@@ -305,19 +1479,19 @@ tagCat(tree_type sid, int qi, int maxDepth, resultList * r1)
       ld = d;
     }
 
-    // head category header
-    int c = cat[id], cend = tree[c], cend2 = tree[c + 1];
-    c += 2;
+    // subcategories (the file list is only read when looking for a file)
+    int nsub;
+    const tree_type * sub = subcatList(id, nsub);
 
     // push all subcat to queue
     if (depth < maxDepth || maxDepth < 0)
     {
       e = (d + 1) << depth_shift;
 
-      while (c < cend)
+      for (int k = 0; k < nsub; ++k)
       {
         // inspect if we are pushing the target cat to the queue
-        if (tree[c] == did)
+        if (sub[k] == did)
         {
           parent[did] = id;
           id = did;
@@ -326,25 +1500,30 @@ tagCat(tree_type sid, int qi, int maxDepth, resultList * r1)
         }
 
         // push unvisited categories into the queue
-        if (tree[c] < maxcat && r1->mask[tree[c]] == 0)
+        if (sub[k] < maxcat && r1->mask[sub[k]] == 0)
         {
-          parent[tree[c]] = id;
-          r1->mask[tree[c]] = 1;
-          rbPush(rb, tree[c] | e);
+          parent[sub[k]] = id;
+          r1->mask.set(sub[k], 1);
+          rbPush(rb, sub[k] | e);
         }
-        c++;
       }
     }
 
     // check if a file in the category is a match
-    if (c2isFile)
+    if (c2isFile && !foundPath)
     {
-      for (c = cend; c < cend2; ++c)
-        if (tree[c] == did)
-        {
-          foundPath = true;
-          break;
-        }
+      fileReader fr;
+      const tree_type * ids;
+      int n;
+      offset_type c = cat[id];
+      fileReaderInit(fr, tree, subcatEnd(tree, c), fileEnd(tree, c), packed);
+      while (!foundPath && (n = fileReaderNext(fr, ids)) > 0)
+        for (int j = 0; j < n; ++j)
+          if (ids[j] == did)
+          {
+            foundPath = true;
+            break;
+          }
     }
   }
 
@@ -395,137 +1574,423 @@ traverse(int qi, resultList * r1)
   for (int i = outstart; i < outend; ++i)
   {
     r = r1->buf[i] & cat_mask;
-    resultQueue(qi, r1->buf[i], r1->tags == NULL ? goodImages->tags[r] : r1->tags[r]);
+    resultQueue(qi, r1->buf[i], r1->tags == NULL ? goodImages->tag(r) : r1->tags[r]);
   }
   resultFlush(qi);
 
+  // more items left?
+  if (outend < r1->num)
+    resultCursor(qi, r1, outend, outend);
+
   // send the (exact) size of the complete result set
   resultPrintf(qi, "OUTOF %d", r1->num);
 }
 
-//
-// all images in result that are not flagged in the mask
-//
-void
-notin(int qi, resultList * r1, resultList * r2)
+// exports are written as RESULT lines of up to expmaxbuf bytes
+const int expmaxbuf = 1024 * 1024, expmaxitem = 40;
+
+// append the decimal representation of v
+inline char *
+exportInt(char * p, uint64_t v)
 {
-  int n = 0; // number of current output item
+  char d[20];
+  int n = 0;
+  do
+  {
+    d[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n)
+    *p++ = d[--n];
+  return p;
+}
 
-  int outstart = queue[qi].o;
-  int outend = outstart + queue[qi].s;
-  onion_response * res = queue[qi].res;
-  onion_websocket * ws = queue[qi].ws;
+// send the buffered RESULT line of an export (false if the client is gone)
+bool
+exportFlush(int qi, int & len)
+{
+  workerContext * ctx = queue[qi].ctx;
+  if (len <= 7)
+    return !ctx->resbroken;
 
-  // No sorting, show least depth first, use mask for NOT test
-  fprintf(stderr, "using mask strategy.\n");
+  if (queue[qi].res)
+  {
+    ctx->expbuf[len - 1] = '\n';
+    if (onion_response_write(queue[qi].res, ctx->expbuf, len) < 0)
+      ctx->resbroken = true;
+  }
+  if (queue[qi].ws && onion_websocket_write(queue[qi].ws, ctx->expbuf, len - 1) < 0)
+    ctx->resbroken = true;
+  len = 7;
+  return !ctx->resbroken;
+}
 
-  // perform subtraction
+// export item: page id in the high 32 bits, depth and tag below
+inline uint64_t
+exportKey(resultList * r1, result_type item)
+{
+  result_type r = item & cat_mask;
+  unsigned char tag = r1->tags == NULL ? goodImages->tag(r) : r1->tags[r];
+  return (uint64_t(uint32_t(pageId(r))) << 32) | (uint64_t((item & depth_mask) >> depth_shift) << 8) | tag;
+}
+
+// sort export items by page id (least significant digit radix sort of the high 32 bits)
+void
+exportSort(uint64_t * & a, int n)
+{
+  uint64_t * b = (uint64_t *)malloc(n * sizeof *b);
+  if (b == NULL)
+  {
+    perror("exportSort()");
+    exit(1);
+  }
+  for (int shift = 32; shift < 64; shift += 8)
+  {
+    int count[257] = {0};
+    for (int j = 0; j < n; ++j)
+      count[((a[j] >> shift) & 0xFF) + 1]++;
+    for (int k = 0; k < 256; ++k)
+      count[k + 1] += count[k];
+    for (int j = 0; j < n; ++j)
+      b[count[(a[j] >> shift) & 0xFF]++] = a[j];
+    uint64_t * t = a;
+    a = b;
+    b = t;
+  }
+  free(b);
+}
+
+//
+// stream the complete result r1 (in traversal order, or sorted by page id) to the
+// client in large writes. The writes block while the client is not reading, and the
+// export stops early when the client is gone.
+//
+void
+exportResult(workerContext * ctx, int qi, resultList * r1)
+{
   pthread_mutex_lock(&(queue[qi].mutex));
   queue[qi].status = WS_STREAMING;
   pthread_cond_signal(&(queue[qi].cond));
   pthread_mutex_unlock(&(queue[qi].mutex));
-  result_type r;
-  int i;
-  for (i = 0; i < r1->num; ++i)
+
+  // items sorted by page id (the result list might be shared with the cache)
+  uint64_t * sorted = NULL;
+  if (queue[qi].sorted && r1->num > 0)
   {
-    r = r1->buf[i] & cat_mask;
+    if ((sorted = (uint64_t *)malloc(r1->num * sizeof *sorted)) == NULL)
+    {
+      perror("exportResult()");
+      exit(1);
+    }
+    for (int j = 0; j < r1->num; ++j)
+      sorted[j] = exportKey(r1, r1->buf[j]);
+    exportSort(sorted, r1->num);
+  }
+
+  if (ctx->expbuf == NULL && (ctx->expbuf = (char *)malloc(expmaxbuf)) == NULL)
+  {
+    perror("exportResult()");
+    exit(1);
+  }
+  memcpy(ctx->expbuf, "RESULT ", 7);
+  int len = 7, j;
+  for (j = 0; j < r1->num; ++j)
+  {
+    uint64_t key = sorted ? sorted[j] : exportKey(r1, r1->buf[j]);
 
-    if (r < maxcat && r2->mask[r] == 0)
+    // binary frames are flushed when they are full
+    if (queue[qi].binary)
     {
-      n++;
-      // are we still below the offset?
-      if (n <= outstart)
-        continue;
-      // output file
-      resultQueue(qi, r1->buf[i], r1->tags == NULL ? goodImages->tags[r] : r1->tags[r]);
-      // are we at the end of the output window?
-      if (n >= outend)
+      resultQueueBinary(qi, key >> 32, (key >> 8) & 0xFFFFFF, key & 0xFF);
+      if (ctx->resbroken)
         break;
+      continue;
     }
+
+    char * p = &(ctx->expbuf[len]);
+    p = exportInt(p, key >> 32);
+    *p++ = ',';
+    p = exportInt(p, (key >> 8) & 0xFFFFFF);
+    *p++ = ',';
+    p = exportInt(p, key & 0xFF);
+    *p++ = '|';
+    len = p - ctx->expbuf;
+    if (len + expmaxitem > expmaxbuf && !exportFlush(qi, len))
+      break;
   }
+  free(sorted);
 
-  resultFlush(qi);
+  if (queue[qi].binary)
+    resultFlush(qi);
+  else
+    exportFlush(qi, len);
+  if (ctx->resbroken)
+  {
+    fprintf(stderr, "Export aborted after %d of %d items [worker %d].\n", j, r1->num, ctx->id);
+    return;
+  }
 
-  // did we make it all the way to the end of the result set?
-  if (i == r1->num)
-    resultPrintf(qi, "OUTOF %d", n - outstart);
-  // otherwise make a crude guess based on the progress within result r1
-  else if (i > 0)
-    resultPrintf(qi, "OUTOF %d", (outend * r1->num) / i);
+  resultPrintf(qi, "OUTOF %d", r1->num);
 }
 
+// progress of a scan over r1 (position of the next item and number of matches so far)
+struct scanState
+{
+  int i, n;
+};
+
 //
-// all images in both c1 and c2 output is sorted by depth in c1
+// output the items of r1 from position s.i on that are flagged (a=and) or not
+// flagged (a=not) in the mask of r2. Returns true once the output window is full.
 //
-void
-intersect(int qi, resultList * r1, resultList * r2)
+bool
+scanResult(int qi, resultList * r1, resultList * r2, scanState & s)
 {
-  int n = 0; // number of current output item
-
   int outstart = queue[qi].o;
   int outend = outstart + queue[qi].s;
-  onion_response * res = queue[qi].res;
-  onion_websocket * ws = queue[qi].ws;
+  bool invert = (queue[qi].type == WT_NOTIN);
 
-  // was one of the results empty?
-  if (r2->num == 0)
-  {
-    resultPrintf(qi, "OUTOF %d", 0);
-    return;
-  }
+  // mask values are fetched in batches
+  const int batch = 64;
+  unsigned char flags[batch];
+  int k = batch;
 
-  // perform intersection
-  pthread_mutex_lock(&(queue[qi].mutex));
-  queue[qi].status = WS_STREAMING;
-  pthread_cond_signal(&(queue[qi].cond));
-  pthread_mutex_unlock(&(queue[qi].mutex));
   result_type r, m;
-
-  int i;
-  for (i = 0; i < r1->num; ++i)
+  for (; s.i < r1->num; ++s.i)
   {
-    r = r1->buf[i] & cat_mask;
+    if (k == batch)
+    {
+      k = r1->num - s.i < batch ? r1->num - s.i : batch;
+      if (r2->bitmapped)
+        for (int j = 0; j < k; ++j)
+          flags[j] = (r = r1->buf[s.i + j] & cat_mask) < maxcat ? r2->probe(r) : 0;
+      else
+        gatherFlags(r1->buf + s.i, k, r2->mask.m, r2->mask.stamp, maxcat, flags);
+      k = 0;
+    }
+    m = flags[k++];
+
+    r = r1->buf[s.i] & cat_mask;
     if (r >= maxcat) continue;
+    if ((m == 0) != invert) continue;
 
-    m = r2->mask[r];
-    if (m != 0)
-    {
-      n++;
-      // are we still below the offset?
-      if (n <= outstart)
-        continue;
+    s.n++;
+    // are we still below the offset?
+    if (s.n <= outstart)
+      continue;
 
-      // output file
+    // output file
+    if (invert)
+      resultQueue(qi, r1->buf[s.i], r1->tags == NULL ? goodImages->tag(r) : r1->tags[r]);
+    else
       resultQueue(qi,
-                  r1->buf[i] + ((m - 1) << depth_shift),
-                  r2->tags == NULL ? goodImages->tags[r] : r2->tags[r]);
+                  r1->buf[s.i] + ((m - 1) << depth_shift),
+                  r2->tags == NULL ? goodImages->tag(r) : r2->tags[r]);
 
-      // are we at the end of the output window?
-      if (n >= outend)
-        break;
+    // are we at the end of the output window?
+    if (s.n >= outend)
+    {
+      s.i++;
+      return true;
     }
   }
 
-  resultFlush(qi);
-
-  // did we make it all the way to the end of the result set?
-  if (i == r1->num)
-    resultPrintf(qi, "OUTOF %d", n - outstart);
-  // otherwise make a crude guess based on the progress within result r1
-  else if (i > 0)
-    resultPrintf(qi, "OUTOF %d", (outend * r1->num) / i);
+  return false;
 }
 
 //
-// all FPs, FVs, QIs, VIs in c1 in that order
+// number of matches in r1 from position i on
 //
-void
-findFQV(int qi, resultList * r1)
+int
+countRest(int qi, resultList * r1, resultList * r2, int i)
 {
-  int n = 0; // number of current output item
-
-  int outstart = queue[qi].o;
-  int outend = outstart + queue[qi].s;
+  bool invert = (queue[qi].type == WT_NOTIN);
+  if (!r2->bitmapped)
+    return countFlagged(r1->buf, i, r1->num, r2->mask.m, r2->mask.stamp, maxcat, invert);
+
+  // both lists cached: intersect the item bitmap of r1 with r2 and
+  // subtract the matches before position i (ids are unique in r1)
+  cacheEntry *e1 = r1->cached, *e2 = r2->cached;
+  if (e1 != NULL)
+  {
+    cache->bitmaps(e1);
+    long n = bmAndCardinality(e1->items, e2->flagged);
+    if (invert) n = bmCardinality(e1->items) - n;
+    for (int j = 0; j < i; ++j)
+    {
+      result_type r = r1->buf[j] & cat_mask;
+      if (r < maxcat && (r2->probe(r) == 0) == invert) n--;
+    }
+    return n;
+  }
+
+  int n = 0;
+  for (; i < r1->num; ++i)
+  {
+    result_type r = r1->buf[i] & cat_mask;
+    if (r < maxcat && (r2->probe(r) == 0) == invert) n++;
+  }
+  return n;
+}
+
+//
+// finish a scan, full indicates that the output window was filled before the end of r1
+//
+void
+scanDone(int qi, resultList * r1, resultList * r2, scanState & s, bool full)
+{
+  int outstart = queue[qi].o;
+  int outend = outstart + queue[qi].s;
+
+  resultFlush(qi);
+
+  // exact count of all matches (count the rest of r1 in a separate pass)
+  if (queue[qi].exact)
+  {
+    int n = s.n;
+    if (full)
+    {
+      resultCursor(qi, r1, s.i, s.n);
+      n += countRest(qi, r1, r2, s.i);
+    }
+    resultPrintf(qi, "OUTOF %d", n);
+    return;
+  }
+
+  // did we make it all the way to the end of the result set? (s.n counts all matches,
+  // including the ones skipped before the offset)
+  if (!full)
+  {
+    resultPrintf(qi, "OUTOF %d", s.n);
+    return;
+  }
+
+  // let the client continue the scan after the last output item
+  resultCursor(qi, r1, s.i, s.n);
+
+  // otherwise make a crude guess based on the progress within result r1
+  if (s.i > 1)
+    resultPrintf(qi, "OUTOF %d", (outend * r1->num) / (s.i - 1));
+}
+
+//
+// all images in result that are not flagged in the mask
+//
+void
+notin(int qi, resultList * r1, resultList * r2)
+{
+  // No sorting, show least depth first, use mask for NOT test
+  fprintf(stderr, "using mask strategy.\n");
+
+  // perform subtraction
+  pthread_mutex_lock(&(queue[qi].mutex));
+  queue[qi].status = WS_STREAMING;
+  pthread_cond_signal(&(queue[qi].cond));
+  pthread_mutex_unlock(&(queue[qi].mutex));
+
+  // resume a previous scan
+  scanState s = {queue[qi].ci, queue[qi].cn};
+  bool full = scanResult(qi, r1, r2, s);
+  scanDone(qi, r1, r2, s, full);
+}
+
+//
+// all images in both c1 and c2 output is sorted by depth in c1
+//
+void
+intersect(int qi, resultList * r1, resultList * r2)
+{
+  // was one of the results empty?
+  if (r2->num == 0)
+  {
+    resultPrintf(qi, "OUTOF %d", 0);
+    return;
+  }
+
+  // perform intersection
+  pthread_mutex_lock(&(queue[qi].mutex));
+  queue[qi].status = WS_STREAMING;
+  pthread_cond_signal(&(queue[qi].cond));
+  pthread_mutex_unlock(&(queue[qi].mutex));
+
+  // resume a previous scan
+  scanState s = {queue[qi].ci, queue[qi].cn};
+  bool full = scanResult(qi, r1, r2, s);
+  scanDone(qi, r1, r2, s, full);
+}
+
+// state of a streamed a=and/a=not query passed to the level hook
+struct streamState
+{
+  int qi;
+  resultList *r1, *r2;
+  scanState s;
+  bool full;
+};
+
+// scan the files of the levels of c1 completed so far (stop once the output window is full)
+bool
+streamLevel(void * data)
+{
+  streamState * st = (streamState *)data;
+  st->full = scanResult(st->qi, st->r1, st->r2, st->s);
+
+  // for a=and nothing can follow once every id flagged in the c2 mask was matched
+  if (queue[st->qi].type == WT_INTERSECT && st->s.n >= st->r2->flagged())
+    return true;
+
+  return st->full;
+}
+
+//
+// a=and and a=not without expanding c1 completely. c1 is traversed level by level
+// and every completed level is scanned against the c2 mask, so the output order is
+// the same as for a complete expansion. The traversal stops as soon as the output
+// window is full (only complete traversals are stored in the cache).
+//
+void
+streamCombine(workerContext * ctx, int qi, resultList * r1, resultList * r2)
+{
+  fprintf(stderr, "using streaming strategy.\n");
+
+  // nothing can be in the intersection with an empty c2
+  if (queue[qi].type == WT_INTERSECT && r2->num == 0)
+  {
+    resultPrintf(qi, "OUTOF %d", 0);
+    return;
+  }
+
+  pthread_mutex_lock(&(queue[qi].mutex));
+  queue[qi].status = WS_STREAMING;
+  pthread_cond_signal(&(queue[qi].cond));
+  pthread_mutex_unlock(&(queue[qi].mutex));
+
+  streamState st = {qi, r1, r2, {0, 0}, false};
+  r1->clear();
+  if (fetchFiles(ctx, queue[qi].c1, queue[qi].d1, r1, streamLevel, &st))
+  {
+    r1->serial = cache ? cache->insert(queue[qi].c1, queue[qi].d1, queue[qi].generation, r1) : 0;
+    fprintf(stderr, "fnum(%d) %d [worker %d, streamed]\n", queue[qi].c1, r1->num, ctx->id);
+  }
+  else
+  {
+    r1->serial = 0;
+    fprintf(stderr, "fnum(%d) %d [worker %d, stopped early]\n", queue[qi].c1, r1->num, ctx->id);
+  }
+
+  scanDone(qi, r1, r2, st.s, st.full);
+}
+
+//
+// all FPs, FVs, QIs, VIs in c1 in that order
+//
+void
+findFQV(int qi, resultList * r1)
+{
+  int n = 0; // number of current output item
+
+  int outstart = queue[qi].o;
+  int outend = outstart + queue[qi].s;
   onion_response * res = queue[qi].res;
   onion_websocket * ws = queue[qi].ws;
 
@@ -552,10 +2017,10 @@ findFQV(int qi, resultList * r1)
     for (i = 0; i < r1->num; ++i)
     {
       r = r1->buf[i] & cat_mask;
-      if (r >= maxcat) continue;
+      if (r >= goodImages->mask.size) continue;
 
       m = goodImages->mask[r];
-      if (m != 0 && k == goodImages->tags[r])
+      if (m != 0 && k == goodImages->tag(r))
       {
         n++;
         // are we still below the offset?
@@ -563,7 +2028,7 @@ findFQV(int qi, resultList * r1)
           continue;
 
         // output file
-        resultQueue(qi, r1->buf[i] + ((m - 1) << depth_shift), goodImages->tags[r]);
+        resultQueue(qi, r1->buf[i] + ((m - 1) << depth_shift), goodImages->tag(r));
 
         // are we at the end of the output window?
         if (n >= outend)
@@ -576,14 +2041,22 @@ findFQV(int qi, resultList * r1)
 
   resultFlush(qi);
 
+  // exact count (all tagged files in c1)
+  if (queue[qi].exact)
+    resultPrintf(qi, "OUTOF %d", countFlagged(r1->buf, 0, r1->num, goodImages->mask.m, goodImages->mask.stamp, goodImages->mask.size, false));
   // did we make it all the way to the end of the result set?
-  if (k == 5)
+  else if (k == 5)
     resultPrintf(qi, "OUTOF %d", n - outstart);
   // otherwise make a crude guess
   else if (((k - 1) * r1->num + i) > 0)
     resultPrintf(qi, "OUTOF %d", (outend * r1->num * 3) / ((k - 1) * r1->num + i));
 }
 
+// live updates are read (not for locked databases or without reloading), and the number
+// of edge changes that did not fit and were set aside in fastcci.delta.rejected
+bool liveUpdates = false;
+long rejectedEdges = 0;
+
 onion_connection_status
 handleStatus(void * d, onion_request * req, onion_response * res)
 {
@@ -593,48 +2066,186 @@ handleStatus(void * d, onion_request * req, onion_response * res)
   double loadavg[3] = {0, 0, 0};
   getloadavg(loadavg, 3);
 
+  database * snapshot = acquireDatabase();
   pthread_mutex_lock(&mutex);
-  onion_response_printf(res, "{\"queue\":%d,\"relsize\":%d,", bItem - aItem, maxcat);
+  onion_response_printf(res, "{\"queue\":%d,\"relsize\":%d,", bItem - aItem, snapshot->maxcat);
   onion_response_printf(res,
-                        "\"dbage\":%.f,\"load\":[%f,%f,%f]}",
-                        difftime(now, treetime),
+                        "\"dbage\":%.f,\"generation\":%u,\"warmup\":%.3f,\"overlay\":{\"edges\":%ld,\"bytes\":%zu,\"rejected\":%ld,\"enabled\":%s},"
+                        "\"load\":[%f,%f,%f]",
+                        difftime(now, snapshot->treetime),
+                        snapshot->generation,
+                        snapshot->loadtime,
+                        snapshot->deltas,
+                        (snapshot->treenum - snapshot->treebase) * sizeof(tree_type),
+                        rejectedEdges,
+                        liveUpdates ? "true" : "false",
                         loadavg[0],
                         loadavg[1],
                         loadavg[2]);
-
   pthread_mutex_unlock(&mutex);
+  releaseDatabase(snapshot);
+
+  if (cache)
+  {
+    pthread_mutex_lock(&(cache->mutex));
+    onion_response_printf(res,
+                          ",\"cache\":{\"hits\":%ld,\"misses\":%ld,\"entries\":%d,\"bytes\":%zu}",
+                          cache->hits,
+                          cache->misses,
+                          cache->nentries,
+                          cache->bytes);
+    pthread_mutex_unlock(&(cache->mutex));
+  }
+  onion_response_printf(res,
+                        ",\"plans\":{\"%s\":%ld,\"%s\":%ld,\"%s\":%ld,\"%s\":%ld}",
+                        planName[QP_BOTH],
+                        planCount[QP_BOTH],
+                        planName[QP_STREAM],
+                        planCount[QP_STREAM],
+                        planName[QP_PROBE],
+                        planCount[QP_PROBE],
+                        planName[QP_UPWARD],
+                        planCount[QP_UPWARD]);
+  onion_response_printf(res, "}");
   return OCS_CLOSE_CONNECTION;
 }
 
-onion_connection_status
-handleRequest(void * d, onion_request * req, onion_response * res)
+//
+// recursive descent parser for query expressions such as "(1:3 & 2) - (3 | 4:1)"
+// (& binds stronger than | and -, an optional :N sets the depth of an operand)
+//
+struct exprParser
 {
-  // parse parameters
-  const char * c1 = onion_request_get_query(req, "c1");
-  const char * c2 = onion_request_get_query(req, "c2");
+  const char * s;
+  workItem * item;
+  bool error;
+};
+
+void
+exprSkip(exprParser & p)
+{
+  while (*p.s == ' ')
+    p.s++;
+}
 
-  if (c1 == NULL)
+int
+exprNew(exprParser & p, char op, int a, int b)
+{
+  workItem * q = p.item;
+  if (q->nexpr >= maxExprNodes)
   {
-    // must supply c1 parameter!
-    fprintf(stderr, "No c1 parameter.\n");
-    return OCS_INTERNAL_ERROR;
+    p.error = true;
+    return 0;
   }
+  exprNode & n = q->expr[q->nexpr];
+  n.op = op;
+  n.a = a;
+  n.b = b;
+  n.cid = 0;
+  n.depth = -1;
+  return q->nexpr++;
+}
 
-  // still room on the queue?
-  pthread_mutex_lock(&mutex);
-  if (bItem - aItem + 1 >= maxItem)
+int exprParseOr(exprParser & p);
+
+int
+exprParseAtom(exprParser & p)
+{
+  exprSkip(p);
+  if (*p.s == '(')
   {
-    // too many requests. reject
-    fprintf(stderr, "Queue full.\n");
-    pthread_mutex_unlock(&mutex);
-    return OCS_INTERNAL_ERROR;
+    p.s++;
+    int n = exprParseOr(p);
+    exprSkip(p);
+    if (*p.s != ')')
+      p.error = true;
+    else
+      p.s++;
+    return n;
   }
-  // new queue item
-  int i = bItem % maxItem;
-  pthread_mutex_unlock(&mutex);
 
-  queue[i].c1 = atoi(c1);
-  queue[i].c2 = c2 ? atoi(c2) : queue[i].c1;
+  // category operand with optional depth
+  char * end;
+  long cid = strtol(p.s, &end, 10);
+  if (end == p.s || !isCategory(cid = denseId(db, cid)))
+  {
+    p.error = true;
+    return 0;
+  }
+  p.s = end;
+
+  int n = exprNew(p, 0, -1, -1);
+  if (p.error)
+    return 0;
+  p.item->expr[n].cid = cid;
+
+  exprSkip(p);
+  if (*p.s == ':')
+  {
+    p.s++;
+    exprSkip(p);
+    long depth = strtol(p.s, &end, 10);
+    if (end == p.s || depth < 0)
+      p.error = true;
+    p.s = end;
+    p.item->expr[n].depth = depth;
+  }
+  return n;
+}
+
+int
+exprParseAnd(exprParser & p)
+{
+  int n = exprParseAtom(p);
+  exprSkip(p);
+  while (!p.error && *p.s == '&')
+  {
+    p.s++;
+    int m = exprParseAtom(p);
+    n = exprNew(p, '&', n, m);
+    exprSkip(p);
+  }
+  return n;
+}
+
+int
+exprParseOr(exprParser & p)
+{
+  int n = exprParseAnd(p);
+  exprSkip(p);
+  while (!p.error && (*p.s == '|' || *p.s == '-'))
+  {
+    char op = *(p.s++);
+    int m = exprParseAnd(p);
+    n = exprNew(p, op, n, m);
+    exprSkip(p);
+  }
+  return n;
+}
+
+// parse a query expression into the work item (returns false on syntax errors or invalid operands)
+bool
+parseQuery(const char * q, workItem * item)
+{
+  exprParser p = {q, item, false};
+  item->nexpr = 0;
+  item->exprRoot = exprParseOr(p);
+  exprSkip(p);
+  return !p.error && *p.s == 0;
+}
+
+//
+// fill queue item i from the request parameters (returns false for invalid requests)
+//
+bool
+parseRequest(onion_request * req, int i, bool bulk)
+{
+  const char * c1 = onion_request_get_query(req, "c1");
+  const char * c2 = onion_request_get_query(req, "c2");
+  const char * qparam = onion_request_get_query(req, "q");
+
+  queue[i].c1 = c1 ? denseId(db, atol(c1)) : 0;
+  queue[i].c2 = c2 ? denseId(db, atol(c2)) : queue[i].c1;
 
   const char * d1 = onion_request_get_query(req, "d1");
   const char * d2 = onion_request_get_query(req, "d2");
@@ -648,6 +2259,24 @@ handleRequest(void * d, onion_request * req, onion_response * res)
   queue[i].o = oparam ? atoi(oparam) : 0;
   queue[i].s = sparam ? atoi(sparam) : 100;
 
+  // count all results exactly
+  const char * eparam = onion_request_get_query(req, "exact");
+  queue[i].exact = (eparam != NULL && strcmp(eparam, "0") != 0);
+
+  // a cursor from a previous page overrides the offset
+  const char * cparam = onion_request_get_query(req, "cursor");
+  queue[i].cursor = (cparam != NULL);
+  queue[i].cserial = 0;
+  queue[i].ci = 0;
+  queue[i].cn = 0;
+  if (cparam != NULL)
+  {
+    if (sscanf(cparam, "%x-%d-%d", &(queue[i].cserial), &(queue[i].ci), &(queue[i].cn)) != 3 ||
+        queue[i].ci < 0 || queue[i].cn < 0)
+      return false;
+    queue[i].o = queue[i].cn;
+  }
+
   // mark initial status
   pthread_mutex_lock(&(queue[i].mutex));
   queue[i].status = WS_WAITING;
@@ -666,36 +2295,120 @@ handleRequest(void * d, onion_request * req, onion_response * res)
       queue[i].type = WT_FQV;
     else if (strcmp(aparam, "list") == 0)
       queue[i].type = WT_TRAVERSE;
+    else if (strcmp(aparam, "parents") == 0)
+    {
+      // needs the reverse index
+      queue[i].type = WT_PARENTS;
+      if (rcat == NULL)
+        return false;
+    }
     else if (strcmp(aparam, "path") == 0)
     {
       queue[i].type = WT_PATH;
       if (queue[i].c1 == queue[i].c2)
-        return OCS_INTERNAL_ERROR;
+        return false;
     }
     else
-      return OCS_INTERNAL_ERROR;
+      return false;
   }
 
-  // check if invalid ids were specified
-  if (queue[i].c1 >= maxcat || queue[i].c2 >= maxcat || queue[i].c1 < 0 || queue[i].c2 < 0)
-    return OCS_INTERNAL_ERROR;
+  // the export of a complete category result
+  const char * sortparam = onion_request_get_query(req, "sort");
+  queue[i].sorted = (sortparam != NULL && strcmp(sortparam, "0") != 0);
+  if (bulk)
+  {
+    queue[i].type = WT_EXPORT;
+    queue[i].c2 = queue[i].c1;
+    aparam = "export";
+    qparam = NULL;
+  }
+
+  // a query expression replaces the c1/c2 operation
+  if (qparam != NULL)
+  {
+    queue[i].type = WT_EXPR;
+    if (!parseQuery(qparam, &(queue[i])))
+    {
+      fprintf(stderr, "Invalid query expression.\n");
+      return false;
+    }
+    aparam = "expr";
+  }
+
+  // check if invalid ids were specified (expression operands are checked by the parser)
+  if (queue[i].type == WT_PARENTS)
+  {
+    // ancestors can be listed for any page in the reverse index
+    if (queue[i].c1 < 0 || queue[i].c1 >= maxrcat)
+      return false;
+  }
+  else if (queue[i].type != WT_EXPR &&
+           (queue[i].c1 >= maxcat || queue[i].c2 >= maxcat || queue[i].c1 < 0 || queue[i].c2 < 0))
+    return false;
 
   // check if both c params are categories unless it is a path request
-  if (isFile(queue[i].c1) || (isFile(queue[i].c2) && queue[i].type != WT_PATH))
-    return OCS_INTERNAL_ERROR;
+  if (queue[i].type != WT_PARENTS && queue[i].type != WT_EXPR &&
+      (isFile(queue[i].c1) || (isFile(queue[i].c2) && queue[i].type != WT_PATH)))
+    return false;
 
   // log request
   if (aparam == NULL)
     aparam = "and";
-  fprintf(stderr,
-          "Request [%ld %d]: a=%s c1=%d(%d) c2=%d(%d)\n",
-          time(NULL),
-          bItem - aItem,
-          aparam,
-          queue[i].c1,
-          queue[i].d1,
-          queue[i].c2,
-          queue[i].d2);
+  if (qparam != NULL)
+    fprintf(stderr, "Request [%ld %d]: q=%s\n", time(NULL), bItem - aItem, qparam);
+  else
+    fprintf(stderr,
+            "Request [%ld %d]: a=%s c1=%d(%d) c2=%d(%d)\n",
+            time(NULL),
+            bItem - aItem,
+            aparam,
+            queue[i].c1,
+            queue[i].d1,
+            queue[i].c2,
+            queue[i].d2);
+
+
+  return true;
+}
+
+onion_connection_status
+handleQuery(onion_request * req, onion_response * res, bool bulk)
+{
+  // an operand is required
+  const char * c1 = onion_request_get_query(req, "c1");
+  const char * qparam = bulk ? NULL : onion_request_get_query(req, "q");
+
+  if (c1 == NULL && qparam == NULL)
+  {
+    // must supply c1 (or q) parameter!
+    fprintf(stderr, "No c1 parameter.\n");
+    return OCS_INTERNAL_ERROR;
+  }
+
+  // still room on the queue? (items currently being computed still occupy their slots)
+  pthread_mutex_lock(&enqueueMutex);
+  pthread_mutex_lock(&mutex);
+  if (bItem - aItem + numWorkers + 1 >= maxItem)
+  {
+    // too many requests. reject
+    fprintf(stderr, "Queue full.\n");
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&enqueueMutex);
+    return OCS_INTERNAL_ERROR;
+  }
+  // new queue item
+  int i = bItem % maxItem;
+  pthread_mutex_unlock(&mutex);
+
+  if (!parseRequest(req, i, bulk))
+  {
+    pthread_mutex_unlock(&enqueueMutex);
+    return OCS_INTERNAL_ERROR;
+  }
+
+  // binary result frames?
+  const char * tparam = onion_request_get_query(req, "t");
+  queue[i].binary = tparam != NULL && strcmp(tparam, "bin") == 0;
 
   // attempt to open a websocket connection
   onion_websocket * ws = onion_websocket_new(req, res);
@@ -709,12 +2422,16 @@ handleRequest(void * d, onion_request * req, onion_response * res)
     onion_response_set_header(res, "Access-Control-Allow-Origin", "*");
 
     // shuld we send a javascript callback for older browsers?
-    const char * tparam = onion_request_get_query(req, "t");
-    if (tparam != NULL && strcmp(tparam, "js") == 0)
+    if (tparam != NULL && strcmp(tparam, "js") == 0 && !bulk)
     {
       queue[i].connection = WC_JS;
       onion_response_set_header(res, "Content-Type", "application/javascript; charset=utf8");
     }
+    else if (queue[i].binary)
+    {
+      queue[i].connection = WC_XHR;
+      onion_response_set_header(res, "Content-Type", "application/octet-stream");
+    }
     else
     {
       queue[i].connection = WC_XHR;
@@ -723,22 +2440,22 @@ handleRequest(void * d, onion_request * req, onion_response * res)
 
     queue[i].res = res;
     queue[i].ws = NULL;
+    queue[i].ctx = NULL;
 
     // append to the queue and signal worker thread
+    queue[i].db = acquireDatabase(db);
     pthread_mutex_lock(&mutex);
     bItem++;
     pthread_cond_signal(&condition);
     pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&enqueueMutex);
 
-    // wait for signal from worker thread
-    wiStatus status;
-    do
-    {
-      pthread_mutex_lock(&(queue[i].mutex));
+    // wait for signal from worker thread (check the status before waiting, the
+    // request might already be done if a worker was idle)
+    pthread_mutex_lock(&(queue[i].mutex));
+    while (queue[i].status != WS_DONE)
       pthread_cond_wait(&(queue[i].cond), &(queue[i].mutex));
-      status = queue[i].status;
-      pthread_mutex_unlock(&(queue[i].mutex));
-    } while (status != WS_DONE);
+    pthread_mutex_unlock(&(queue[i].mutex));
   }
   else
   {
@@ -749,14 +2466,17 @@ handleRequest(void * d, onion_request * req, onion_response * res)
     queue[i].connection = WC_SOCKET;
     queue[i].ws = ws;
     queue[i].res = NULL;
+    queue[i].ctx = NULL;
 
     onion_websocket_printf(ws, "QUEUED %d", i - aItem);
 
     // append to the queue and signal worker thread
+    queue[i].db = acquireDatabase(db);
     pthread_mutex_lock(&mutex);
     bItem++;
     pthread_cond_signal(&condition);
     pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&enqueueMutex);
 
     // wait for signal from worker thread (have a third thread periodically signal, only print
     // result when the calculation is done, otherwise print status)
@@ -778,8 +2498,11 @@ handleRequest(void * d, onion_request * req, onion_response * res)
           break;
         case WS_PREPROCESS:
         case WS_COMPUTING:
-          // send intermediate result sizes
-          onion_websocket_printf(ws, "WORKING %d %d", result[0]->num, result[1]->num);
+          // send intermediate result sizes of the worker processing this item
+          onion_websocket_printf(ws,
+                                 "WORKING %d %d",
+                                 queue[i].ctx->result[0]->num,
+                                 queue[i].ctx->result[1]->num);
           break;
       }
       // don't do anything if status is WS_STREAMING, the compute task is sending data
@@ -790,6 +2513,28 @@ handleRequest(void * d, onion_request * req, onion_response * res)
   return OCS_CLOSE_CONNECTION;
 }
 
+onion_connection_status
+handleRequest(void * d, onion_request * req, onion_response * res)
+{
+  // validate and queue the request on the current database snapshot
+  database * snapshot = acquireDatabase();
+  useDatabase(snapshot);
+  onion_connection_status status = handleQuery(req, res, false);
+  releaseDatabase(snapshot);
+  return status;
+}
+
+onion_connection_status
+handleExport(void * d, onion_request * req, onion_response * res)
+{
+  // queue the export of a complete result on the current database snapshot
+  database * snapshot = acquireDatabase();
+  useDatabase(snapshot);
+  onion_connection_status status = handleQuery(req, res, true);
+  releaseDatabase(snapshot);
+  return status;
+}
+
 void *
 notifyThread(void * d)
 {
@@ -804,175 +2549,1565 @@ notifyThread(void * d)
     pthread_mutex_lock(&handlerMutex);
     pthread_mutex_lock(&mutex);
 
-    // loop over all active queue items (actually lock &mutex as well!)
-    for (int i = aItem; i < bItem; ++i)
+    // loop over all active queue items (waiting and possibly being computed)
+    int a = aItem > numWorkers ? aItem - numWorkers : 0;
+    for (int j = a; j < bItem; ++j)
+    {
+      int i = j % maxItem;
       if (queue[i].connection == WC_SOCKET)
       {
         pthread_mutex_lock(&(queue[i].mutex));
         pthread_cond_signal(&(queue[i].cond));
         pthread_mutex_unlock(&(queue[i].mutex));
       }
+    }
 
     pthread_mutex_unlock(&mutex);
     pthread_mutex_unlock(&handlerMutex);
   }
 }
 
-void *
-computeThread(void * d)
+//
+// estimate the number of items in and below category 'id' from the direct file counts in
+// the tree headers of a breadth first search sample (exact for small acyclic closures)
+//
+long
+estimateFiles(workerContext * ctx, tree_type id, int depth)
 {
-  while (1)
+  ringBuffer & rb = ctx->rb;
+  rbClear(rb);
+  rbPush(rb, id);
+
+  long files = 0;
+  int n = 0;
+  result_type r, d, i;
+  while (!rbEmpty(rb) && n < planSample)
   {
-    // wait for pthread condition
-    pthread_mutex_lock(&mutex);
-    while (aItem == bItem)
-      pthread_cond_wait(&condition, &mutex);
-    pthread_mutex_unlock(&mutex);
+    r = rbPop(rb);
+    d = (r & depth_mask) >> depth_shift;
+    i = r & cat_mask;
+    if (i >= maxcat) continue;
+    n++;
 
-    // process queue
-    while (bItem > aItem)
+    offset_type c = cat[i], cend = subcatEnd(tree, c), cfile = fileEnd(tree, c);
+    c += 2;
+
+    // push subcats (without deduplication) or count them as items at the depth limit
+    if (d < depth || depth < 0)
+    {
+      for (; c < cend; ++c)
+        if (tree[c] < maxcat && cat[tree[c]] > 0)
+          rbPush(rb, tree[c] | ((d + 1) << depth_shift));
+    }
+    else
+      files += cend - c;
+
+    files += fileCount(tree, cend, cfile, packed);
+  }
+
+  // extrapolate for the categories that were not sampled
+  if (n > 0)
+    files += (long)(rb.b - rb.a) * files / n;
+
+  return files;
+}
+
+//
+// choose a strategy for an a=and or a=not query based on the closure sizes of c1 and c2
+// (known for cached results, estimated otherwise)
+//
+queryPlan
+planQuery(workerContext * ctx, int qi, bool have[2])
+{
+  resultList ** result = ctx->result;
+  long est[2];
+  est[0] = have[0] ? result[0]->num : estimateFiles(ctx, queue[qi].c1, queue[qi].d1);
+  est[1] = have[1] ? result[1]->num : estimateFiles(ctx, queue[qi].c2, queue[qi].d2);
+
+  queryPlan plan;
+  if (have[0] && have[1])
+    plan = QP_BOTH;
+  // c1 is much smaller than c2 (check the parents of its files if the reverse index is loaded)
+  else if (!have[1] && rcat != NULL && est[0] * planRatio < est[1])
+    plan = QP_UPWARD;
+  // c1 is available or much smaller than c2
+  else if (!have[1] && (have[0] || est[0] * planRatio < est[1]))
+    plan = QP_PROBE;
+  // a cursor needs the complete c1 result to be retained in the cache, an exact count the complete c1
+  else if (!have[0] && !queue[qi].cursor && !queue[qi].exact)
+    plan = QP_STREAM;
+  else
+    plan = QP_BOTH;
+
+  __sync_fetch_and_add(&(planCount[plan]), 1);
+  fprintf(stderr,
+          "Plan: %s c1=%d(%s%ld) c2=%d(%s%ld) [worker %d]\n",
+          planName[plan],
+          queue[qi].c1,
+          have[0] ? "" : "~",
+          est[0],
+          queue[qi].c2,
+          have[1] ? "" : "~",
+          est[1],
+          ctx->id);
+  return plan;
+}
+
+// expand the complete closure of a category and store it in the cache
+void
+expandCategory(workerContext * ctx, int qi, int cid, int depth, resultList * r)
+{
+  r->clear();
+  r->num = 0;
+  fetchFiles(ctx, cid, depth, r);
+  fprintf(stderr, "fnum(%d) %d [worker %d]\n", cid, r->num, ctx->id);
+  r->serial = cache ? cache->insert(cid, depth, queue[qi].generation, r) : 0;
+}
+
+// state of a c2 traversal that only needs to find the items of c1 (k items already found)
+struct probeState
+{
+  resultList *r1, *r2;
+  int k;
+};
+
+// check if all items of c1 have been found in the levels of c2 completed so far (their
+// depths are final then, and intersect() needs a non-empty c2)
+bool
+probeLevel(void * data)
+{
+  probeState * ps = (probeState *)data;
+  result_type r;
+  for (; ps->k < ps->r1->num; ++ps->k)
+  {
+    r = ps->r1->buf[ps->k] & cat_mask;
+    if (r < maxcat && ps->r2->mask[r] == 0)
+      return false;
+  }
+  return ps->r2->num > 0;
+}
+
+// traverse c2 until all items of c1 are found (only complete traversals are cached)
+void
+probeCategory(workerContext * ctx, int qi, int cid, int depth, resultList * r1, resultList * r2)
+{
+  probeState ps = {r1, r2, 0};
+  r2->clear();
+  if (fetchFiles(ctx, cid, depth, r2, probeLevel, &ps))
+  {
+    fprintf(stderr, "fnum(%d) %d [worker %d]\n", cid, r2->num, ctx->id);
+    r2->serial = cache ? cache->insert(cid, depth, queue[qi].generation, r2) : 0;
+  }
+  else
+  {
+    fprintf(stderr, "fnum(%d) %d [worker %d, stopped early]\n", cid, r2->num, ctx->id);
+    r2->serial = 0;
+  }
+}
+
+//
+// restrict c2 to the items of c1 without expanding the files of c2. Only the categories
+// of c2 are traversed, the depth of a c1 file in c2 is the least depth of its parents
+// visited in that traversal (the result is not complete and is not cached)
+//
+void
+upwardCategory(workerContext * ctx, int cid, int depth, resultList * r1, resultList * r2)
+{
+  ringBuffer & rb = ctx->rb;
+  tree_type * level = ctx->parent;
+
+  rbClear(rb);
+  rbPush(rb, cid);
+  r2->clear();
+  r2->num = 0;
+  r2->serial = 0;
+
+  // breadth first search over the categories, record the depth of each visited category
+  int k = 0;
+  result_type d;
+  while (!rbEmpty(rb))
+  {
+    d = (rb.buf[rb.a & rb.mask] & depth_mask) >> depth_shift;
+    expandLevel(rb, rb.b - rb.a, depth, r2, false);
+    for (; k < r2->cats.num; ++k)
+      level[r2->cats.buf[k]] = d;
+  }
+
+  // one hop parent check for the files of c1 (a mask value of 1 also marks subcategories
+  // listed at depth limit 0, which are not visited)
+  result_type f, m;
+  int j;
+  offset_type p;
+  for (j = 0; j < r1->num; ++j)
+  {
+    f = r1->buf[j] & cat_mask;
+    if (f >= maxcat || f >= maxrcat || cat[f] >= 0) continue;
+
+    m = 0;
+    for (p = rcat[f]; p < rcat[f + 1]; ++p)
+      if (r2->mask[rtree[p]] == 1 && (depth != 0 || rtree[p] == cid) && (m == 0 || level[rtree[p]] + 1 < m))
+        m = level[rtree[p]] + 1;
+
+    if (m != 0)
+    {
+      r2->mask.set(f, m < 255 ? m : 255);
+      r2->grow(1);
+      r2->buf[r2->num++] = f | ((m - 1) << depth_shift);
+    }
+  }
+
+  fprintf(stderr, "fnum(%d) %d [worker %d, upward]\n", cid, r2->num, ctx->id);
+}
+
+// add the unvisited parents of page i at depth d to the result and the ring buffer
+void
+pushParents(ringBuffer & rb, resultList * r1, result_type i, result_type d)
+{
+  if (i >= result_type(maxrcat)) return;
+
+  for (offset_type p = rcat[i]; p < rcat[i + 1]; ++p)
+    if (rtree[p] < maxcat && r1->mask[rtree[p]] == 0)
+    {
+      r1->mask.set(rtree[p], 1);
+      r1->grow(1);
+      r1->buf[r1->num++] = rtree[p] | (d << depth_shift);
+      rbPush(rb, rtree[p] | (d << depth_shift));
+    }
+}
+
+//
+// all ancestor categories of page 'id' in a breadth first search up to depth 'depth'
+// (direct parents have depth 0, if 'depth' is negative treat it as infinity)
+//
+void
+fetchParents(workerContext * ctx, tree_type id, int depth, resultList * r1)
+{
+  ringBuffer & rb = ctx->rb;
+
+  rbClear(rb);
+  r1->clear();
+  r1->num = 0;
+  r1->serial = 0;
+
+  // do not list the start category as its own ancestor
+  if (id < maxcat)
+    r1->mask.set(id, 1);
+
+  pushParents(rb, r1, id, 0);
+
+  result_type r, d;
+  while (!rbEmpty(rb))
+  {
+    r = rbPop(rb);
+    d = (r & depth_mask) >> depth_shift;
+    if (d < depth || depth < 0)
+      pushParents(rb, r1, r & cat_mask, d + 1);
+  }
+}
+
+// id sorted list of (id, depth) items of a query expression node
+struct exprList
+{
+  result_type * buf;
+  int num;
+};
+
+int
+compareId(const void * a, const void * b)
+{
+  result_type x = (*(result_type *)a) & cat_mask, y = (*(result_type *)b) & cat_mask;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// size estimate of an expression node
+long
+exprEstimate(workerContext * ctx, workItem * q, int n)
+{
+  exprNode & e = q->expr[n];
+  long a, b;
+  switch (e.op)
+  {
+    case 0:
+      return estimateFiles(ctx, e.cid, e.depth);
+    case '&':
+      a = exprEstimate(ctx, q, e.a);
+      b = exprEstimate(ctx, q, e.b);
+      return a < b ? a : b;
+    case '|':
+      return exprEstimate(ctx, q, e.a) + exprEstimate(ctx, q, e.b);
+    default:
+      return exprEstimate(ctx, q, e.a);
+  }
+}
+
+// collect the operands of a chain of the same associative operator
+void
+exprCollect(workItem * q, int n, char op, int * ops, int & nops)
+{
+  if (q->expr[n].op == op)
+  {
+    exprCollect(q, q->expr[n].a, op, ops, nops);
+    exprCollect(q, q->expr[n].b, op, ops, nops);
+  }
+  else
+    ops[nops++] = n;
+}
+
+// merge two id sorted lists (frees both inputs). The depth of an intersection item is
+// the sum of the operand depths, a union item gets the least depth, a difference keeps
+// the depth of the left operand.
+exprList
+exprMerge(char op, exprList x, exprList y)
+{
+  exprList r;
+  r.num = 0;
+  r.buf = (result_type *)malloc((op == '|' ? x.num + y.num : x.num) * sizeof *(r.buf) + 1);
+  if (r.buf == NULL)
+  {
+    perror("exprMerge()");
+    exit(1);
+  }
+
+  int i = 0, j = 0;
+  if (op == '|')
+  {
+    result_type a, b;
+    while (i < x.num && j < y.num)
+    {
+      a = x.buf[i] & cat_mask;
+      b = y.buf[j] & cat_mask;
+      if (a < b)
+        r.buf[r.num++] = x.buf[i++];
+      else if (b < a)
+        r.buf[r.num++] = y.buf[j++];
+      else
+      {
+        r.buf[r.num++] = (x.buf[i] & depth_mask) < (y.buf[j] & depth_mask) ? x.buf[i] : y.buf[j];
+        i++;
+        j++;
+      }
+    }
+    while (i < x.num)
+      r.buf[r.num++] = x.buf[i++];
+    while (j < y.num)
+      r.buf[r.num++] = y.buf[j++];
+  }
+  else
+  {
+    // positions of the common ids
+    int m = x.num < y.num ? x.num : y.num;
+    int * ix = (int *)malloc(2 * m * sizeof *ix + 1), *iy = ix + m;
+    if (ix == NULL)
+    {
+      perror("exprMerge()");
+      exit(1);
+    }
+    m = intersectSorted(x.buf, x.num, y.buf, y.num, ix, iy);
+
+    if (op == '&')
+      for (j = 0; j < m; ++j)
+        r.buf[r.num++] = x.buf[ix[j]] + (y.buf[iy[j]] & depth_mask);
+    else
+      for (j = 0; j <= m; ++j)
+      {
+        // items of x between two common ids
+        int end = j < m ? ix[j] : x.num;
+        while (i < end)
+          r.buf[r.num++] = x.buf[i++];
+        i++;
+      }
+    free(ix);
+  }
+
+  free(x.buf);
+  free(y.buf);
+  return r;
+}
+
+//
+// evaluate an expression node into an id sorted list. Every operand is expanded once
+// (or taken from the cache), chains of & are intersected in the order of increasing
+// estimated size and stop early once the intersection is empty.
+//
+exprList
+evalExpr(workerContext * ctx, int qi, int n)
+{
+  workItem * q = &(queue[qi]);
+  exprNode & e = q->expr[n];
+  resultList * r = ctx->result[0];
+  exprList l;
+
+  // category operand
+  if (e.op == 0)
+  {
+    cacheEntry * c = cache ? cache->lookup(e.cid, e.depth, q->generation) : NULL;
+    if (c)
+      r->attach(c, false);
+    else
+      expandCategory(ctx, qi, e.cid, e.depth, r);
+
+    l.num = r->num;
+    if ((l.buf = (result_type *)malloc(l.num * sizeof *(l.buf) + 1)) == NULL)
+    {
+      perror("evalExpr()");
+      exit(1);
+    }
+    memcpy(l.buf, r->buf, l.num * sizeof *(l.buf));
+    r->detach();
+    qsort(l.buf, l.num, sizeof *(l.buf), compareId);
+    return l;
+  }
+
+  // difference
+  if (e.op == '-')
+  {
+    l = evalExpr(ctx, qi, e.a);
+    if (l.num == 0)
+      return l;
+    return exprMerge('-', l, evalExpr(ctx, qi, e.b));
+  }
+
+  // associative chain, smallest operands first
+  int ops[maxExprNodes], nops = 0, j, k;
+  long est[maxExprNodes];
+  exprCollect(q, n, e.op, ops, nops);
+  for (j = 0; j < nops; ++j)
+    est[j] = exprEstimate(ctx, q, ops[j]);
+  for (j = 1; j < nops; ++j)
+    for (k = j; k > 0 && est[k] < est[k - 1]; --k)
+    {
+      long t = est[k];
+      est[k] = est[k - 1];
+      est[k - 1] = t;
+      int o = ops[k];
+      ops[k] = ops[k - 1];
+      ops[k - 1] = o;
+    }
+
+  l = evalExpr(ctx, qi, ops[0]);
+  for (j = 1; j < nops; ++j)
+  {
+    if (e.op == '&' && l.num == 0)
+      break;
+    l = exprMerge(e.op, l, evalExpr(ctx, qi, ops[j]));
+  }
+  return l;
+}
+
+//
+// evaluate a query expression and output the results ordered by depth (and id within
+// a depth level) with an exact total count
+//
+void
+queryExpr(workerContext * ctx, int qi)
+{
+  exprList l = evalExpr(ctx, qi, queue[qi].exprRoot);
+
+  // counting sort by depth
+  int maxd = 0, j, d;
+  for (j = 0; j < l.num; ++j)
+  {
+    d = (l.buf[j] & depth_mask) >> depth_shift;
+    if (d > maxd)
+      maxd = d;
+  }
+  int * count = (int *)calloc(maxd + 2, sizeof *count);
+  if (count == NULL)
+  {
+    perror("queryExpr()");
+    exit(1);
+  }
+  for (j = 0; j < l.num; ++j)
+    count[((l.buf[j] & depth_mask) >> depth_shift) + 1]++;
+  for (d = 1; d <= maxd; ++d)
+    count[d] += count[d - 1];
+
+  resultList * r1 = ctx->result[0];
+  r1->num = 0;
+  r1->grow(l.num);
+  for (j = 0; j < l.num; ++j)
+    r1->buf[count[(l.buf[j] & depth_mask) >> depth_shift]++] = l.buf[j];
+  r1->num = l.num;
+  r1->serial = 0;
+  free(count);
+  free(l.buf);
+
+  fprintf(stderr, "qnum %d [worker %d]\n", r1->num, ctx->id);
+  traverse(qi, r1);
+}
+
+void *
+computeThread(void * d)
+{
+  workerContext * ctx = (workerContext *)d;
+  resultList ** result = ctx->result;
+
+  while (1)
+  {
+    // wait for pthread condition and claim the next item in the queue
+    pthread_mutex_lock(&mutex);
+    while (aItem == bItem)
+      pthread_cond_wait(&condition, &mutex);
+    int i = aItem % maxItem;
+    aItem++;
+    pthread_mutex_unlock(&mutex);
+
+    // attach this worker's traversal context to the item
+    queue[i].ctx = ctx;
+
+    // compute on the database snapshot the item was validated against (results are
+    // cached for the generation it has now, live updates may patch it while we run)
+    database * snapshot = queue[i].db;
+    queue[i].generation = __sync_add_and_fetch(&(snapshot->generation), 0);
+    useDatabase(snapshot);
+    ctx->fit();
+
+    // signal start of compute
+    resultStart(i);
+    // mark request as preprocessing/working
+    pthread_mutex_lock(&(queue[i].mutex));
+    queue[i].status = WS_PREPROCESS;
+    pthread_cond_signal(&(queue[i].cond));
+    pthread_mutex_unlock(&(queue[i].mutex));
+
+    int nr = 0;
+    if (queue[i].type == WT_PATH)
+    {
+      // path finding
+      result[0]->clear();
+      // mark as streaming for path responses
+      pthread_mutex_lock(&(queue[i].mutex));
+      queue[i].status = WS_STREAMING;
+      pthread_cond_signal(&(queue[i].cond));
+      pthread_mutex_unlock(&(queue[i].mutex));
+      tagCat(queue[i].c1, i, queue[i].d1, result[0]);
+    }
+    else if (queue[i].type == WT_EXPR)
+    {
+      // boolean query expression over many categories
+      queryExpr(ctx, i);
+    }
+    else if (queue[i].type == WT_PARENTS)
+    {
+      // ancestor categories (upward breadth first search)
+      fetchParents(ctx, queue[i].c1, queue[i].d1, result[0]);
+      fprintf(stderr, "pnum(%d) %d [worker %d]\n", queue[i].c1, result[0]->num, ctx->id);
+      traverse(i, result[0]);
+    }
+    else
+    {
+      // boolean operations (AND, LIST, NOTIN)
+      result[0]->num = 0;
+      result[1]->num = 0;
+      pthread_mutex_lock(&(queue[i].mutex));
+      queue[i].status = WS_PREPROCESS;
+      pthread_cond_signal(&(queue[i].cond));
+      pthread_mutex_unlock(&(queue[i].mutex));
+
+      // generate intermediate results
+      int cid[2] = {queue[i].c1, queue[i].c2};
+      int depth[2] = {queue[i].d1, queue[i].d2};
+      // number of result lists needed
+      nr = (queue[i].type == WT_TRAVERSE || queue[i].type == WT_FQV || queue[i].type == WT_EXPORT) ? 1 : 2;
+      bool have[2] = {false, false};
+      for (int j = 0; j < nr; ++j)
+      {
+        // previously expanded closure (only the c2 visitation mask is used in the operations below)
+        cacheEntry * e = cache ? cache->lookup(cid[j], depth[j], queue[i].generation) : NULL;
+        if (e)
+        {
+          result[j]->attach(e, j == 1);
+          fprintf(stderr, "fnum(%d) %d [worker %d, cached]\n", cid[j], result[j]->num, ctx->id);
+          have[j] = true;
+        }
+      }
+
+      // choose a strategy for boolean operations
+      queryPlan plan = nr == 2 ? planQuery(ctx, i, have) : QP_BOTH;
+
+      // expand c2 first (unless it is probed or checked upwards for the items of c1)
+      if (nr == 2 && !have[1] && plan != QP_PROBE && plan != QP_UPWARD)
+        expandCategory(ctx, i, cid[1], depth[1], result[1]);
+      // expand c1 (unless it is streamed against the c2 mask)
+      if (!have[0] && plan != QP_STREAM)
+        expandCategory(ctx, i, cid[0], depth[0], result[0]);
+      // traverse c2 only until all items of c1 are found
+      if (nr == 2 && !have[1] && plan == QP_PROBE)
+        probeCategory(ctx, i, cid[1], depth[1], result[0], result[1]);
+      // traverse the c2 categories only and check the parents of the c1 files
+      if (nr == 2 && !have[1] && plan == QP_UPWARD)
+        upwardCategory(ctx, cid[1], depth[1], result[0], result[1]);
+
+      // a cursor can only resume the scan on the very same c1 result it was issued for,
+      // otherwise rescan from the start and skip the number of items already delivered
+      if (queue[i].cserial == 0 || queue[i].cserial != result[0]->serial)
+        queue[i].ci = queue[i].cn = 0;
+      else if (queue[i].ci > result[0]->num)
+        queue[i].ci = result[0]->num;
+
+      // compute result
+      pthread_mutex_lock(&(queue[i].mutex));
+      queue[i].status = WS_COMPUTING;
+      pthread_cond_signal(&(queue[i].cond));
+      pthread_mutex_unlock(&(queue[i].mutex));
+
+      switch (queue[i].type)
+      {
+        case WT_TRAVERSE:
+          traverse(i, result[0]);
+          break;
+        case WT_FQV:
+          findFQV(i, result[0]);
+          break;
+        case WT_EXPORT:
+          exportResult(ctx, i, result[0]);
+          break;
+
+        case WT_NOTIN:
+          if (plan == QP_STREAM)
+            streamCombine(ctx, i, result[0], result[1]);
+          else
+            notin(i, result[0], result[1]);
+          break;
+        case WT_INTERSECT:
+          if (plan == QP_STREAM)
+            streamCombine(ctx, i, result[0], result[1]);
+          else
+            intersect(i, result[0], result[1]);
+          break;
+
+        // answered above
+        case WT_EXPR:
+        case WT_PARENTS:
+          break;
+      }
+    }
+
+    // report database age
+    time_t now = time(NULL);
+    resultPrintf(i, "DBAGE %.f", difftime(now, treetime));
+
+    // done with this request
+    resultDone(i);
+    pthread_mutex_lock(&(queue[i].mutex));
+    queue[i].status = WS_DONE;
+    pthread_cond_signal(&(queue[i].cond));
+    pthread_mutex_unlock(&(queue[i].mutex));
+
+    // return borrowed cache entries and try to shrink result buffers used in this request
+    for (int j = 0; j < nr; ++j)
+    {
+      result[j]->detach();
+      result[j]->shrink();
+    }
+    releaseDatabase(snapshot);
+  }
+}
+
+// largest category block (in entries) a live update had to copy so far. Changed blocks are
+// copied whole, so the tree headroom of later loads is sized to hold a few of them.
+size_t largestDeltaBlock = 0;
+
+//
+// map the database files in datadir into a new snapshot (returns NULL if the category
+// or tree file is missing)
+//
+database *
+loadDatabase(const char * datadir)
+{
+  const int buflen = 1000;
+  char fname[buflen], tname[buflen];
+  struct stat statbuf;
+
+  snprintf(fname, buflen, "%s/fastcci.cat", datadir);
+  snprintf(tname, buflen, "%s/fastcci.tree", datadir);
+  if (stat(fname, &statbuf) == -1 || stat(tname, &statbuf) == -1)
+  {
+    fprintf(stderr, "Database files missing in %s.\n", datadir);
+    return NULL;
+  }
+
+  timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  // map cat and tree privately with headroom for live updates (locked databases are
+  // mapped read-only and do not take live updates)
+  bool reserve = !residency.lock;
+  database * d = new database;
+  if (!dbLoadGraph(datadir, d->catfile, d->treefile, reserve, 4 * largestDeltaBlock))
+  {
+    delete d;
+    return NULL;
+  }
+  d->cat = (offset_type *)d->catfile.data;
+  d->maxcat = d->catfile.count;
+  d->tree = (tree_type *)d->treefile.data;
+  d->treebase = d->treenum = d->treefile.count;
+  d->packed = d->treefile.flags & dbPacked;
+  d->deltas = 0;
+
+  // page id tables of databases with dense ids (with headroom for live updates)
+  d->pageids = d->idorder = d->newids = NULL;
+  d->norder = 0;
+  d->retired = NULL;
+  d->nretired = 0;
+  memset(&d->idsfile, 0, sizeof d->idsfile);
+  memset(&d->idorderfile, 0, sizeof d->idorderfile);
+  if (d->catfile.flags & dbDense)
+  {
+    snprintf(fname, buflen, "%s/fastcci.ids", datadir);
+    snprintf(tname, buflen, "%s/fastcci.idorder", datadir);
+    if (!dbLoad(fname, DB_IDS, d->idsfile, reserve) || !dbLoad(tname, DB_IDORDER, d->idorderfile) ||
+        d->idsfile.count != d->catfile.count || d->idorderfile.count != d->catfile.count)
+    {
+      fprintf(stderr, "Missing or mismatched page id tables in %s.\n", datadir);
+      dbRelease(d->catfile);
+      dbRelease(d->treefile);
+      dbRelease(d->idsfile);
+      dbRelease(d->idorderfile);
+      delete d;
+      return NULL;
+    }
+    d->pageids = (tree_type *)d->idsfile.data;
+    d->idorder = (tree_type *)d->idorderfile.data;
+    d->norder = d->idorderfile.count;
+  }
+
+  // get modification time of tree file
+  d->treetime = statbuf.st_mtime;
+
+  // read the reverse index files (optional, needed for ancestor queries)
+  d->maxrcat = 0;
+  d->rcat = NULL;
+  d->rtree = NULL;
+  memset(&d->rcatfile, 0, sizeof d->rcatfile);
+  memset(&d->rtreefile, 0, sizeof d->rtreefile);
+  snprintf(fname, buflen, "%s/fastcci.rcat", datadir);
+  snprintf(tname, buflen, "%s/fastcci.rtree", datadir);
+  if (stat(fname, &statbuf) == 0)
+  {
+    if (dbLoad(fname, DB_RCAT, d->rcatfile) && dbLoad(tname, DB_RTREE, d->rtreefile) && d->rcatfile.count > 0)
+    {
+      d->rcat = (offset_type *)d->rcatfile.data;
+      d->maxrcat = d->rcatfile.count - 1;
+      d->rtree = (tree_type *)d->rtreefile.data;
+    }
+    else
+    {
+      fprintf(stderr, "Unusable reverse index, ancestor queries are disabled.\n");
+      dbRelease(d->rcatfile);
+    }
+  }
+  else
+    fprintf(stderr, "No reverse index, ancestor queries are disabled.\n");
+
+  d->reverse = (d->rcat != NULL);
+
+  // read the subcategory index (optional, path searches and upward checks read the tree
+  // without it)
+  d->maxscat = 0;
+  d->scat = NULL;
+  d->stree = NULL;
+  memset(&d->scatfile, 0, sizeof d->scatfile);
+  memset(&d->streefile, 0, sizeof d->streefile);
+  snprintf(fname, buflen, "%s/fastcci.scat", datadir);
+  snprintf(tname, buflen, "%s/fastcci.stree", datadir);
+  if (stat(fname, &statbuf) == 0)
+  {
+    if (dbLoad(fname, DB_SCAT, d->scatfile) && dbLoad(tname, DB_STREE, d->streefile) &&
+        d->scatfile.count > 0 && d->scatfile.count <= size_t(d->maxcat) + 1)
+    {
+      d->scat = (offset_type *)d->scatfile.data;
+      d->maxscat = d->scatfile.count - 1;
+      d->stree = (tree_type *)d->streefile.data;
+    }
+    else
+    {
+      fprintf(stderr, "Unusable subcategory index.\n");
+      dbRelease(d->scatfile);
+      dbRelease(d->streefile);
+    }
+  }
+  else
+    fprintf(stderr, "No subcategory index.\n");
+
+  d->subcats = (d->scat != NULL);
+
+  // completion marker written by fastcci_build_db
+  snprintf(fname, buflen, "%s/done", datadir);
+  d->donetime = stat(fname, &statbuf) == 0 ? statbuf.st_mtime : 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  d->loadtime = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+  fprintf(stderr,
+          "Loaded database in %.3fs%s%s%s.\n",
+          d->loadtime,
+          residency.prefault ? " (prefaulted)" : "",
+          residency.lock ? " (locked)" : "",
+          residency.huge == HUGE_EXPLICIT ? " (explicit huge pages)" : residency.huge == HUGE_THP ? " (transparent huge pages)" : "");
+
+  d->goodImages = NULL;
+  d->generation = 0;
+  d->refs = 1;
+  return d;
+}
+
+//
+// precompute a union of Commons FPs, Wikipedia FPs, Commons FVs, QIs, and VIs on the
+// database snapshot of the calling thread (using the result lists of ctx)
+//
+resultList *
+buildGoodImages(workerContext * ctx)
+{
+  int goodCats[][3] = {
+      {3943817, 0, 1}, // [[Category:Featured_pictures_on_Wikimedia_Commons]]     (depth 0)
+      {5799448, 1, 1}, // [[Category:Featured_pictures_on_Wikipedia_by_language]] (depth 1)
+      {91039287, 0, 2}, // [[Category:Featured_media]]                            (depth 0)
+      {3618826, 0, 3}, // [[Category:Quality_images]]                             (depth 0)
+      {4143367, 0, 4}  // [[Category:Valued_images_sorted_by_promotion_date]]     (depth 0)
+  };
+  resultList * good = new resultList(512);
+  good->clear();
+  good->addTags();
+  result_type r;
+  resultList ** result = ctx->result;
+  for (int i = 5; i > 0; --i)
+  {
+    printf("goodImages[%d]\n", i);
+    result[0]->clear();
+    result[0]->num = 0;
+    long id = denseId(db, goodCats[i - 1][0]);
+    if (id < 0)
+      continue;
+    fetchFiles(ctx, id, goodCats[i - 1][1], result[0]);
+    for (int j = 0; j < result[0]->num; j++)
     {
-      // fetch next item
-      int i = aItem % maxItem;
+      r = result[0]->buf[j] & cat_mask;
+      if (r < maxcat)
+      {
+        good->mask.set(r, result[0]->mask[r]);
+        good->tags[r] = goodCats[i - 1][2];
+      }
+    }
+  }
+  good->num = -1;
+  return good;
+}
 
-      // signal start of compute
-      resultStart(i);
-      // mark request as preprocessing/working
-      pthread_mutex_lock(&(queue[i].mutex));
-      queue[i].status = WS_PREPROCESS;
-      pthread_cond_signal(&(queue[i].cond));
-      pthread_mutex_unlock(&(queue[i].mutex));
+// one edge change of a live update (seq is the line number, later changes win)
+struct edgeDelta
+{
+  tree_type from, to;
+  char type;
+  bool add, present;
+  int seq;
+};
+
+// order by child only (for lookups within the changes of one parent)
+int
+compareDeltaEdge(const void * a, const void * b)
+{
+  tree_type x = ((const edgeDelta *)a)->from, y = ((const edgeDelta *)b)->from;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+int
+compareDelta(const void * a, const void * b)
+{
+  const edgeDelta *x = (const edgeDelta *)a, *y = (const edgeDelta *)b;
+  if (x->to != y->to)
+    return x->to < y->to ? -1 : 1;
+  if (x->from != y->from)
+    return x->from < y->from ? -1 : 1;
+  return x->seq - y->seq;
+}
+
+//
+// read a delta file with one 'cl_from cl_to type +|-' edge change per line. The changes are
+// returned sorted by parent and child, with only the last change of each edge kept.
+//
+int
+readDelta(const char * fname, edgeDelta *& e)
+{
+  FILE * in = fopen(fname, "r");
+  if (in == NULL)
+    return 0;
 
-      int nr = 0;
-      if (queue[i].type == WT_PATH)
+  int max = 1024, n = 0, bad = 0;
+  if ((e = (edgeDelta *)malloc(max * sizeof *e)) == NULL)
+  {
+    perror("readDelta()");
+    exit(1);
+  }
+
+  char buf[200], type[10], sign;
+  int from, to;
+  while (fgets(buf, 200, in))
+  {
+    if (sscanf(buf, "%d %d %9s %c", &from, &to, type, &sign) != 4 || from < 0 || to < 0 ||
+        (type[0] != 's' && type[0] != 'f') || (sign != '+' && sign != '-'))
+    {
+      bad++;
+      continue;
+    }
+
+    if (n == max)
+    {
+      max *= 2;
+      if ((e = (edgeDelta *)realloc(e, max * sizeof *e)) == NULL)
       {
-        // path finding
-        result[0]->clear();
-        // mark as streaming for path responses
-        pthread_mutex_lock(&(queue[i].mutex));
-        queue[i].status = WS_STREAMING;
-        pthread_cond_signal(&(queue[i].cond));
-        pthread_mutex_unlock(&(queue[i].mutex));
-        tagCat(queue[i].c1, i, queue[i].d1, result[0]);
+        perror("readDelta()");
+        exit(1);
       }
-      else
+    }
+    e[n].from = from;
+    e[n].to = to;
+    e[n].type = type[0];
+    e[n].add = (sign == '+');
+    e[n].present = false;
+    e[n].seq = n;
+    n++;
+  }
+  fclose(in);
+  if (bad)
+    fprintf(stderr, "Skipped %d malformed lines in %s.\n", bad, fname);
+
+  // keep the last change of each edge
+  qsort(e, n, sizeof *e, compareDelta);
+  int m = 0;
+  for (int j = 0; j < n; ++j)
+  {
+    if (m > 0 && e[m - 1].to == e[j].to && e[m - 1].from == e[j].from)
+      m--;
+    e[m++] = e[j];
+  }
+  return m;
+}
+
+//
+// map the page ids of the n edge changes e to the ids of snapshot d (which has dense ids)
+// in the new array t, sorted like e. Pages that are not in the graph yet get new ids
+// after the existing ones (their page ids are stored right away), the merged list of
+// added ids is returned in added for the caller to publish. Returns false if the new ids
+// do not fit into the reserved regions.
+//
+bool
+translateDelta(database * d, const edgeDelta * e, int n, edgeDelta *& t, tree_type *& added)
+{
+  // page ids without an id (sorted and unique)
+  tree_type * fresh = (tree_type *)malloc((2 * n + 1) * sizeof *fresh);
+  t = (edgeDelta *)malloc((n + 1) * sizeof *t);
+  if (fresh == NULL || t == NULL)
+  {
+    perror("translateDelta()");
+    exit(1);
+  }
+  int nfresh = 0;
+  for (int j = 0; j < n; ++j)
+  {
+    if (denseId(d, e[j].from) < 0)
+      fresh[nfresh++] = e[j].from;
+    if (denseId(d, e[j].to) < 0)
+      fresh[nfresh++] = e[j].to;
+  }
+  qsort(fresh, nfresh, sizeof *fresh, compareU32);
+  int m = 0;
+  for (int j = 0; j < nfresh; ++j)
+    if (m == 0 || fresh[m - 1] != fresh[j])
+      fresh[m++] = fresh[j];
+  nfresh = m;
+
+  tree_type base = d->maxcat;
+  if (size_t(base) + nfresh > d->idsfile.capacity || size_t(base) + nfresh > d->catfile.capacity)
+  {
+    free(fresh);
+    free(t);
+    return false;
+  }
+
+  // translate the edges (new pages get their ids in page id order)
+  for (int j = 0; j < n; ++j)
+  {
+    t[j] = e[j];
+    for (int k = 0; k < 2; ++k)
+    {
+      tree_type & id = k ? t[j].to : t[j].from;
+      long dense = denseId(d, id);
+      if (dense < 0)
+        dense = base + ((tree_type *)bsearch(&id, fresh, nfresh, sizeof *fresh, compareU32) - fresh);
+      id = dense;
+    }
+  }
+  qsort(t, n, sizeof *t, compareDelta);
+
+  // store the page ids of the new ids and merge them into the added ids
+  added = NULL;
+  if (nfresh == 0)
+  {
+    free(fresh);
+    return true;
+  }
+  for (int j = 0; j < nfresh; ++j)
+    d->pageids[base + j] = fresh[j];
+  int nold = d->newids ? d->newids[0] : 0, i = 0, j = 0;
+  added = (tree_type *)malloc((nold + nfresh + 1) * sizeof *added);
+  if (added == NULL)
+  {
+    perror("translateDelta()");
+    exit(1);
+  }
+  added[0] = nold + nfresh;
+  for (int k = 1; k <= nold + nfresh; ++k)
+    if (j == nfresh || (i < nold && d->pageids[d->newids[i + 1]] < fresh[j]))
+      added[k] = d->newids[++i];
+    else
+      added[k] = base + j++;
+
+  free(fresh);
+  return true;
+}
+
+//
+// apply n edge changes to the graph of snapshot d. Every changed category gets a new
+// block appended to the tree (a full copy of the old one with the changes merged in),
+// which is then published by pointing the category index at it. Queries running
+// concurrently see either the old or the new version of each block, but a traversal
+// can meet some blocks before and some after the update. Returns false (without
+// changing anything) if the changes do not fit into the reserved regions.
+//
+bool
+applyDelta(database * d, edgeDelta * e, int n)
+{
+  offset_type * cat = d->cat;
+  tree_type * tree = d->tree;
+
+  // work on the ids of databases with dense ids
+  edgeDelta * t = NULL;
+  tree_type * added = NULL;
+  if (d->pageids != NULL)
+  {
+    if (!translateDelta(d, e, n, t, added))
+      return false;
+    e = t;
+  }
+
+  // check the capacity (upper bound of the new blocks, note the largest one)
+  size_t need = 0, block = 0;
+  tree_type maxid = d->maxcat - 1;
+  offset_type c;
+  for (int j = 0; j < n; ++j)
+  {
+    if (e[j].from > maxid)
+      maxid = e[j].from;
+    if (e[j].to > maxid)
+      maxid = e[j].to;
+    if (j == 0 || e[j].to != e[j - 1].to)
+    {
+      need += 3;
+      block = 3;
+      if (e[j].to < d->maxcat && (c = cat[e[j].to]) > 0)
       {
-        // boolean operations (AND, LIST, NOTIN)
-        result[0]->num = 0;
-        result[1]->num = 0;
-        pthread_mutex_lock(&(queue[i].mutex));
-        queue[i].status = WS_PREPROCESS;
-        pthread_cond_signal(&(queue[i].cond));
-        pthread_mutex_unlock(&(queue[i].mutex));
+        size_t len = tree[c] + fileCount(tree, subcatEnd(tree, c), fileEnd(tree, c), d->packed);
+        need += len;
+        block += len;
+      }
+    }
+    if (e[j].add)
+    {
+      need++;
+      block++;
+    }
+    if (block > largestDeltaBlock)
+      largestDeltaBlock = block;
+  }
+  if (size_t(maxid) >= d->catfile.capacity || d->treenum + need > d->treefile.capacity)
+  {
+    free(t);
+    free(added);
+    return false;
+  }
 
-        // generate intermediate results
-        int cid[2] = {queue[i].c1, queue[i].c2};
-        int depth[2] = {queue[i].d1, queue[i].d2};
-        // number of result lists needed
-        nr = (queue[i].type == WT_TRAVERSE || queue[i].type == WT_FQV) ? 1 : 2;
-        for (int j = 0; j < nr; ++j)
+  // disable the indices that stop matching the graph before any block changes (the
+  // subcategory index stays valid as long as files were only added)
+  for (int j = 0; j < n; ++j)
+    if (e[j].type == 's' || !e[j].add)
+      d->subcats = false;
+  d->reverse = false;
+  __sync_synchronize();
+
+  // new page ids are files until they are added as a subcategory (or get subcategories
+  // or files themselves), subcategories without a block point to the empty dummy category
+  for (tree_type i = d->maxcat; i <= maxid; ++i)
+    cat[i] = -1;
+  for (int j = 0; j < n; ++j)
+    if (e[j].add && e[j].type == 's' && cat[e[j].from] == -1)
+      cat[e[j].from] = 0;
+  for (int j = 0; j < n; ++j)
+    if (cat[e[j].to] == -1)
+      cat[e[j].to] = 0;
+
+  // rebuild the block of every changed category
+  int j0 = 0, j1, maxbuf = 0;
+  tree_type * buf = NULL;
+  fileReader fr;
+  for (; j0 < n; j0 = j1)
+  {
+    tree_type p = e[j0].to;
+    for (j1 = j0; j1 < n && e[j1].to == p; ++j1)
+      ;
+
+    size_t pos = d->treenum;
+    tree_type * out = &(tree[pos + 2]);
+    int nsub = 0, nfile = 0;
+
+    // keep existing children that are not removed (and note the ones re-added)
+    c = cat[p];
+    fileReaderInit(fr, tree, subcatEnd(tree, c), fileEnd(tree, c), d->packed);
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      const tree_type * ids = &(tree[c + 2]);
+      int m = pass ? fileReaderNext(fr, ids) : tree[c];
+      for (; m > 0; m = pass ? fileReaderNext(fr, ids) : 0)
+        for (int k = 0; k < m; ++k)
         {
-          // clear visitation mask
-          result[j]->clear();
-
-          // fetch files through deep traversal
-          fetchFiles(cid[j], depth[j], result[j]);
-          fprintf(stderr, "fnum(%d) %d\n", cid[j], result[j]->num);
+          edgeDelta key;
+          key.to = p;
+          key.from = ids[k];
+          edgeDelta * f = (edgeDelta *)bsearch(&key, &(e[j0]), j1 - j0, sizeof key, compareDeltaEdge);
+          if (f && !f->add)
+            continue;
+          if (f)
+            f->present = true;
+          out[nsub + nfile] = ids[k];
+          pass ? nfile++ : nsub++;
         }
 
-        // compute result
-        pthread_mutex_lock(&(queue[i].mutex));
-        queue[i].status = WS_COMPUTING;
-        pthread_cond_signal(&(queue[i].cond));
-        pthread_mutex_unlock(&(queue[i].mutex));
-
-        switch (queue[i].type)
+      // append new children of this kind (subcategories must be categories, files must not be)
+      for (int j = j0; j < j1; ++j)
+        if (e[j].add && !e[j].present && e[j].type == (pass ? 'f' : 's') &&
+            (pass ? cat[e[j].from] == -1 : cat[e[j].from] >= 0))
         {
-          case WT_TRAVERSE:
-            traverse(i, result[0]);
-            break;
-          case WT_FQV:
-            findFQV(i, result[0]);
-            break;
+          out[nsub + nfile] = e[j].from;
+          pass ? nfile++ : nsub++;
+        }
+    }
 
-          case WT_NOTIN:
-            notin(i, result[0], result[1]);
-            break;
-          case WT_INTERSECT:
-            intersect(i, result[0], result[1]);
-            break;
+    // pre-sort the file list (and pack it like the rest of the tree)
+    qsort(&(out[nsub]), nfile, sizeof *out, compare);
+    if (d->packed)
+    {
+      if (nfile + 1 > maxbuf)
+      {
+        maxbuf = nfile + 1;
+        if ((buf = (tree_type *)realloc(buf, maxbuf * sizeof *buf)) == NULL)
+        {
+          perror("applyDelta()");
+          exit(1);
         }
       }
+      int nword = packFiles(&(out[nsub]), nfile, buf);
+      memcpy(&(out[nsub]), buf, nword * sizeof *buf);
+      nfile = nword;
+    }
+    tree[pos] = nsub;
+    tree[pos + 1] = nfile;
+    d->treenum = pos + 2 + nsub + nfile;
 
-      // report database age
-      time_t now = time(NULL);
-      resultPrintf(i, "DBAGE %.f", difftime(now, treetime));
-
-      // done with this request
-      resultDone(i);
-      pthread_mutex_lock(&(queue[i].mutex));
-      queue[i].status = WS_DONE;
-      pthread_cond_signal(&(queue[i].cond));
-      pthread_mutex_unlock(&(queue[i].mutex));
+    // publish the block
+    __sync_synchronize();
+    cat[p] = pos;
+  }
 
-      // try to shrink result buffers uses in this request
-      for (int j = 0; j < nr; ++j)
-        result[j]->shrink();
+  free(buf);
 
-      // pop item off queue
-      pthread_mutex_lock(&mutex);
-      aItem++;
-      pthread_mutex_unlock(&mutex);
+  __sync_synchronize();
+  if (maxid >= d->maxcat)
+    d->maxcat = maxid + 1;
 
-      // wake up thread to finish connection
-      // Already signaled above under queue[i].mutex
+  // publish the page ids added by this delta (the previous list may still be searched)
+  if (added != NULL)
+  {
+    if (d->newids != NULL)
+    {
+      if ((d->retired = (tree_type **)realloc(d->retired, (d->nretired + 1) * sizeof *(d->retired))) == NULL)
+      {
+        perror("applyDelta()");
+        exit(1);
+      }
+      d->retired[d->nretired++] = d->newids;
     }
+    __sync_synchronize();
+    d->newids = added;
   }
+
+  free(t);
+  d->treetime = time(NULL);
+  d->deltas += n;
+  return true;
 }
 
-int
-main(int argc, char * argv[])
+//
+// write the (patched) graph of snapshot d as new base files into datadir, with fresh
+// reverse and subcategory indices and done marker. Blocks are rewritten in page id order
+// without the replaced copies. The files are written under temporary names and renamed
+// when complete.
+//
+bool
+compactDatabase(database * d, const char * datadir)
 {
-  if (argc != 3)
+  const int buflen = 1000;
+  const char * names[] = {"fastcci.cat", "fastcci.tree", "fastcci.rcat", "fastcci.rtree",
+                          "fastcci.scat", "fastcci.stree", "fastcci.ids", "fastcci.idorder"};
+  char fname[8][buflen], tname[8][buflen];
+  FILE * out[8];
+  bool ok = true;
+  int nfiles = d->pageids ? 8 : 6;
+  for (int k = 0; k < nfiles; ++k)
   {
-    printf("%s PORT DATADIR\n", argv[0]);
-    return 1;
+    snprintf(fname[k], buflen, "%s/%s", datadir, names[k]);
+    snprintf(tname[k], buflen, "%s/.%s.compact", datadir, names[k]);
+    if ((out[k] = fopen(tname[k], "w")) == NULL)
+    {
+      perror(tname[k]);
+      ok = false;
+    }
   }
 
-  // ring buffer for breadth first
-  rbInit(rb);
+  if (ok)
+  {
+    // headers are written again with the final counts and checksums
+    uint32_t catflags = d->pageids ? dbDense : 0;
+    ok = dbWriteHeader(out[0], DB_CAT, catflags, 0, 0) && dbWriteHeader(out[1], DB_TREE, d->packed ? dbPacked : 0, 0, 0);
+
+    // empty dummy category at tree[0]
+    tree_type h[2] = {0, 0};
+    offset_type pos = 2, c;
+    uint64_t catsum = dbChecksum(NULL, 0), treesum = dbChecksum(h, sizeof h);
+    ok = ok && fwrite(h, sizeof *h, 2, out[1]) == 2;
+    for (int i = 0; ok && i < d->maxcat; ++i)
+    {
+      // files (-1) and categories without a block (0) are copied as they are, blocks
+      // are copied verbatim (their header holds lengths only)
+      c = d->cat[i];
+      offset_type o = c <= 0 ? c : pos;
+      ok = fwrite(&o, sizeof o, 1, out[0]) == 1;
+      catsum = dbChecksum(&o, sizeof o, catsum);
+      if (c <= 0)
+        continue;
+
+      size_t len = fileEnd(d->tree, c) - c;
+      ok = ok && fwrite(&(d->tree[c]), sizeof *(d->tree), len, out[1]) == len;
+      treesum = dbChecksum(&(d->tree[c]), len * sizeof *(d->tree), treesum);
+      pos += len;
+    }
+    ok = ok && dbWriteHeader(out[0], DB_CAT, catflags, d->maxcat, catsum) &&
+         dbWriteHeader(out[1], DB_TREE, d->packed ? dbPacked : 0, pos, treesum);
 
-  const int buflen = 1000;
-  char fname[buflen];
+    if (ok)
+    {
+      offset_type * rc;
+      tree_type * rt;
+      int nrc;
+      size_t nrt;
+      buildReverseIndex(d->cat, d->maxcat, d->tree, d->packed, rc, nrc, rt, nrt);
+      ok = dbWriteHeader(out[2], DB_RCAT, 0, nrc, dbChecksum(rc, nrc * sizeof *rc)) &&
+           dbWriteHeader(out[3], DB_RTREE, 0, nrt, dbChecksum(rt, nrt * sizeof *rt)) &&
+           fwrite(rc, sizeof *rc, nrc, out[2]) == size_t(nrc) && fwrite(rt, sizeof *rt, nrt, out[3]) == nrt;
+      free(rc);
+      free(rt);
+    }
 
-  snprintf(fname, buflen, "%s/fastcci.cat", argv[2]);
-  unsigned int cat_file_len = readFile(fname, cat);
-  maxcat = cat_file_len / sizeof(tree_type);
+    if (ok)
+    {
+      offset_type * sc;
+      tree_type * st;
+      int nsc;
+      size_t nst;
+      buildSubcatIndex(d->cat, d->maxcat, d->tree, sc, nsc, st, nst);
+      ok = dbWriteHeader(out[4], DB_SCAT, 0, nsc, dbChecksum(sc, nsc * sizeof *sc)) &&
+           dbWriteHeader(out[5], DB_STREE, 0, nst, dbChecksum(st, nst * sizeof *st)) &&
+           fwrite(sc, sizeof *sc, nsc, out[4]) == size_t(nsc) && fwrite(st, sizeof *st, nst, out[5]) == nst;
+      free(sc);
+      free(st);
+    }
 
-  // result structures (including visitation mask buffer)
-  result[0] = new resultList(1024 * 1024);
-  result[1] = new resultList(1024 * 1024);
-  goodImages = new resultList(512);
+    // page id tables, the ids added by live updates are merged into the page id order
+    if (ok && d->pageids)
+    {
+      tree_type * order = (tree_type *)malloc((size_t(d->maxcat) + 1) * sizeof *order);
+      if (order == NULL)
+      {
+        perror("compactDatabase()");
+        exit(1);
+      }
+      int nadded = d->newids ? d->newids[0] : 0, i = 0, j = 0;
+      for (int k = 0; k < d->norder + nadded; ++k)
+        if (j == nadded || (i < d->norder && d->pageids[d->idorder[i]] < d->pageids[d->newids[j + 1]]))
+          order[k] = d->idorder[i++];
+        else
+          order[k] = d->newids[1 + j++];
+
+      size_t n = d->maxcat;
+      ok = size_t(d->norder + nadded) == n &&
+           dbWriteHeader(out[6], DB_IDS, 0, n, dbChecksum(d->pageids, n * sizeof *order)) &&
+           dbWriteHeader(out[7], DB_IDORDER, 0, n, dbChecksum(order, n * sizeof *order)) &&
+           fwrite(d->pageids, sizeof *order, n, out[6]) == n && fwrite(order, sizeof *order, n, out[7]) == n;
+      free(order);
+    }
+  }
 
-  // parent category buffer for shortest path finding
-  if ((parent = (tree_type *)malloc(maxcat * sizeof *parent)) == NULL)
+  for (int k = 0; k < nfiles; ++k)
+    if (out[k] && fclose(out[k]) != 0)
+      ok = false;
+  for (int k = 0; k < nfiles; ++k)
+    if (!ok)
+      unlink(tname[k]);
+    else if (rename(tname[k], fname[k]) != 0)
+    {
+      perror(fname[k]);
+      ok = false;
+    }
+  if (!ok)
   {
-    perror("parent");
-    exit(1);
+    fprintf(stderr, "Compaction failed.\n");
+    return false;
   }
 
-  // read tree file
-  snprintf(fname, buflen, "%s/fastcci.tree", argv[2]);
-  unsigned int tree_file_len = readFile(fname, tree);
+  snprintf(fname[0], buflen, "%s/done", datadir);
+  FILE * done = fopen(fname[0], "w");
+  if (done)
+  {
+    fprintf(done, "OK\n");
+    fclose(done);
+  }
+  fprintf(stderr, "Compacted %ld live updates into %s.\n", d->deltas, datadir);
+  return true;
+}
+
+// seconds between checks for a new database or live updates (0 disables both)
+int reloadInterval = 10;
+
+//
+// map a new database from datadir and precompute its good images off the query path
+// (using the traversal buffers of ctx), then make it the current snapshot. Queries pinned
+// to the previous snapshot finish on it, and it is unmapped when the last of them releases it.
+//
+bool
+reloadDatabase(const char * datadir, workerContext *& ctx)
+{
+  database * next = loadDatabase(datadir);
+  if (next == NULL)
+    return false;
+  next->generation = current->generation + 1;
+
+  useDatabase(next);
+  if (ctx == NULL)
+    ctx = new workerContext(-1);
+  else
+    ctx->fit();
+  next->goodImages = buildGoodImages(ctx);
+
+  // swap (new requests pin the new snapshot from here on)
+  pthread_mutex_lock(&databaseMutex);
+  database * old = current;
+  current = next;
+  pthread_mutex_unlock(&databaseMutex);
+
+  if (cache)
+    cache->invalidate(next->generation);
+  fprintf(stderr, "Reloaded database (generation %u, %d page ids).\n", next->generation, next->maxcat);
+  releaseDatabase(old);
+  return true;
+}
+
+//
+// set aside the n edge changes e that could not be applied by appending them to the
+// file rejected (in the delta format, so they can be renamed to fastcci.delta again
+// once there is room)
+//
+void
+rejectDelta(const char * rejected, edgeDelta * e, int n)
+{
+  FILE * out = fopen(rejected, "a");
+  if (out == NULL)
+  {
+    perror(rejected);
+    return;
+  }
+  for (int j = 0; j < n; ++j)
+    fprintf(out, "%d %d %s %c\n", e[j].from, e[j].to, e[j].type == 's' ? "subcat" : "file", e[j].add ? '+' : '-');
+  if (fclose(out) != 0)
+    perror(rejected);
+  __sync_add_and_fetch(&rejectedEdges, n);
+  fprintf(stderr, "%d edge changes do not fit, set aside in %s.\n", n, rejected);
+}
+
+//
+// watch datadir for a new database (the done marker written by fastcci_build_db or a copy
+// job) and for live updates (fastcci.delta). Live updates are applied to the current
+// snapshot and compacted into new base files once they fill half of the reserved space.
+// A batch that does not fit even after a compaction is applied in parts (split at category
+// boundaries), a change that does not fit on its own is set aside.
+//
+void *
+reloadThread(void * d)
+{
+  const char * datadir = (const char *)d;
+  const int buflen = 1000;
+  char donename[buflen], deltaname[buflen], workname[buflen], rejectname[buflen];
+  snprintf(donename, buflen, "%s/done", datadir);
+  snprintf(deltaname, buflen, "%s/fastcci.delta", datadir);
+  snprintf(workname, buflen, "%s/fastcci.delta.applying", datadir);
+  snprintf(rejectname, buflen, "%s/fastcci.delta.rejected", datadir);
+
+  // private traversal buffers for the precomputation
+  workerContext * ctx = NULL;
 
-  // get modification time of tree file
   struct stat statbuf;
-  if (stat(fname, &statbuf) == -1)
+  while (1)
   {
-    perror(fname);
-    exit(1);
+    sleep(reloadInterval);
+
+    // only this thread replaces or patches the current snapshot
+    if (stat(donename, &statbuf) == 0 && statbuf.st_mtime != current->donetime)
+      reloadDatabase(datadir, ctx);
+
+    // take the pending delta file (writers create a new one), locked databases are
+    // read-only and only replaced as a whole
+    if (liveUpdates && rename(deltaname, workname) == 0)
+    {
+      edgeDelta * e = NULL;
+      int n = readDelta(workname, e), j = 0, m = n;
+      bool compacted = false;
+      while (j < n)
+      {
+        if (applyDelta(current, &(e[j]), m))
+        {
+          if (cache)
+            cache->advance(current);
+          else
+            __sync_add_and_fetch(&(current->generation), 1);
+          fprintf(stderr, "Applied %d edge changes (generation %u).\n", m, current->generation);
+          j += m;
+          m = n - j;
+          compacted = false;
+          continue;
+        }
+
+        // fold the previous updates into a new base to make room
+        if (!compacted && current->deltas > 0)
+        {
+          compacted = true;
+          if (compactDatabase(current, datadir) && reloadDatabase(datadir, ctx))
+            continue;
+        }
+
+        // a single change that does not fit is set aside
+        if (m == 1)
+        {
+          rejectDelta(rejectname, &(e[j]), 1);
+          j++;
+          m = n - j;
+          continue;
+        }
+
+        // otherwise try the first half (split between categories if possible)
+        int h = m / 2;
+        while (h > 0 && e[j + h].to == e[j + h - 1].to)
+          h--;
+        if (h == 0)
+          for (h = m / 2; h < m && e[j + h].to == e[j + h - 1].to; ++h)
+            ;
+        m = h < m ? h : m / 2;
+      }
+      free(e);
+      unlink(workname);
+    }
+
+    // compact once half of the reserved tree space is used
+    if (current->treenum - current->treebase > (current->treefile.capacity - current->treebase) / 2 &&
+        compactDatabase(current, datadir))
+      reloadDatabase(datadir, ctx);
+  }
+  return NULL;
+}
+
+int
+main(int argc, char * argv[])
+{
+  // parse command line options
+  int opt, cacheSize = 256;
+  bool badHuge = false;
+  while ((opt = getopt(argc, argv, "w:t:c:r:plH:VS")) != -1)
+  {
+    switch (opt)
+    {
+      case 'w':
+        numWorkers = atoi(optarg);
+        break;
+      case 't':
+        numTraversalThreads = atoi(optarg);
+        break;
+      case 'c':
+        cacheSize = atoi(optarg);
+        break;
+      case 'r':
+        reloadInterval = atoi(optarg);
+        break;
+      case 'p':
+        residency.prefault = true;
+        break;
+      case 'l':
+        residency.lock = true;
+        break;
+      case 'V':
+        dbVerify = true;
+        break;
+      case 'S':
+        scalarKernels = true;
+        break;
+      case 'H':
+        if (strcmp(optarg, "thp") == 0)
+          residency.huge = HUGE_THP;
+        else if (strcmp(optarg, "explicit") == 0)
+          residency.huge = HUGE_EXPLICIT;
+        else
+          badHuge = true;
+        break;
+      default:
+        numWorkers = 0;
+    }
+  }
+  if (argc - optind != 2 || numWorkers < 1 || numTraversalThreads < 1 || cacheSize < 0 || reloadInterval < 0 || badHuge)
+  {
+    printf("%s [-w WORKERS] [-t TRAVERSAL_THREADS] [-c CACHE_MB] [-r RELOAD_SECONDS] [-p] [-l] [-H thp|explicit] [-V] [-S] PORT DATADIR\n",
+           argv[0]);
+    return 1;
   }
-  treetime = statbuf.st_mtime;
+  const char * port = argv[optind];
+  const char * datadir = argv[optind + 1];
+
+  // map the initial database (startup is timed until the server is ready)
+  timespec start, ready;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((current = loadDatabase(datadir)) == NULL)
+    exit(1);
+  useDatabase(current);
+
+  // compute workers, each with its own result structures (including visitation mask buffers),
+  // ring buffer, parent category buffer, and output buffer
+  worker = new workerContext *[numWorkers];
+  for (int j = 0; j < numWorkers; ++j)
+    worker[j] = new workerContext(j);
+
+  // traversal result cache
+  if (cacheSize > 0)
+    cache = new resultCache(size_t(cacheSize) * 1024 * 1024);
+
+  // thread teams for parallel expansion of large traversal levels
+  if (numTraversalThreads > 1)
+    for (int j = 0; j < numWorkers; ++j)
+      worker[j]->team = new traversalTeam(numTraversalThreads);
 
   // thread properties
   pthread_attr_t attr;
@@ -986,65 +4121,54 @@ main(int argc, char * argv[])
     pthread_cond_init(&(queue[qi].cond), NULL);
   }
 
-  // setup compute thread
-  pthread_t compute_thread;
-  if (pthread_create(&compute_thread, &attr, computeThread, NULL))
-    return 1;
-
-  // setup compute thread
+  // setup notify thread
   pthread_t notify_thread;
   if (pthread_create(&notify_thread, &attr, notifyThread, NULL))
     return 1;
 
-  // precompute a union of Commons FPs, Wikipedia FPs, Commons FVs, QIs, and VIs
-  int goodCats[][3] = {
-      {3943817, 0, 1}, // [[Category:Featured_pictures_on_Wikimedia_Commons]]     (depth 0)
-      {5799448, 1, 1}, // [[Category:Featured_pictures_on_Wikipedia_by_language]] (depth 1)
-      {91039287, 0, 2}, // [[Category:Featured_media]]                            (depth 0)
-      {3618826, 0, 3}, // [[Category:Quality_images]]                             (depth 0)
-      {4143367, 0, 4}  // [[Category:Valued_images_sorted_by_promotion_date]]     (depth 0)
-  };
-  goodImages->clear();
-  goodImages->addTags();
-  result_type r;
-  for (int i = 5; i > 0; --i)
-  {
-    printf("goodImages[%d]\n", i);
-    result[0]->clear();
-    result[0]->num = 0;
-    fetchFiles(goodCats[i - 1][0], goodCats[i - 1][1], result[0]);
-    for (int j = 0; j < result[0]->num; j++)
-    {
-      r = result[0]->buf[j] & cat_mask;
-      if (r < maxcat)
-      {
-        goodImages->mask[r] = result[0]->mask[r];
-        goodImages->tags[r] = goodCats[i - 1][2];
-      }
-    }
-  }
-  goodImages->num = -1;
+  // precompute the good images of the initial database
+  current->goodImages = buildGoodImages(worker[0]);
+  useDatabase(current);
+
+  // watch for database updates
+  liveUpdates = reloadInterval > 0 && !residency.lock;
+  if (reloadInterval > 0 && residency.lock)
+    fprintf(stderr, "Live updates are disabled for a locked database, fastcci.delta is not read.\n");
+  pthread_t reload_thread;
+  if (reloadInterval > 0 && pthread_create(&reload_thread, &attr, reloadThread, (void *)datadir))
+    return 1;
+
+  // setup compute worker threads (after the precomputation above is done with worker 0)
+  for (int j = 0; j < numWorkers; ++j)
+    if (pthread_create(&(worker[j]->thread), &attr, computeThread, worker[j]))
+      return 1;
+  fprintf(stderr, "Started %d compute worker(s).\n", numWorkers);
 
   // start webserver
   onion * o = onion_new(O_THREADED);
 
-  onion_set_port(o, argv[1]);
+  onion_set_port(o, port);
   onion_set_hostname(o, "0.0.0.0");
   onion_set_timeout(o, 1000000000);
 
   // add handlers
   onion_url * url = onion_root_url(o);
   onion_url_add(url, "status", (void *)handleStatus);
+  onion_url_add(url, "export", (void *)handleExport);
   onion_url_add(url, "", (void *)handleRequest);
 
-  fprintf(stderr, "Server ready. [%ld,%ld]\n", sizeof(tree_type), sizeof(result_type));
+  clock_gettime(CLOCK_MONOTONIC, &ready);
+  fprintf(stderr,
+          "Server ready after %.3fs warmup. [%ld,%ld]\n",
+          (ready.tv_sec - start.tv_sec) + (ready.tv_nsec - start.tv_nsec) * 1e-9,
+          sizeof(tree_type),
+          sizeof(result_type));
   int error = onion_listen(o);
   if (error)
     perror("Cant create the server");
 
   onion_free(o);
 
-  munmap(cat, cat_file_len);
-  munmap(tree, tree_file_len);
+  releaseDatabase(current);
   return 0;
 }
@@ -0,0 +1,241 @@
+// vectorized kernels for the set operations of the server. Every kernel has a scalar
+// version, the dispatchers pick the fastest version supported by the cpu at runtime.
+// Items are result_type values, only their ids (low 32 bits) are compared.
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// use the scalar versions only (to check the vectorized kernels against them)
+bool scalarKernels = false;
+
+//
+// visitation mask probing. m is the mask buffer of maxid entries, each entry holds the
+// epoch it was written in (high byte) and its value (low byte), stamp is the current epoch.
+//
+
+inline unsigned char maskValue(const uint16_t *m, uint16_t stamp, int maxid, result_type r) {
+  if (r >= maxid) return 0;
+  unsigned int v = m[r] ^ stamp;
+  return v < 256 ? v : 0;
+}
+
+// count the items in buf[from] to buf[to-1] that are flagged (or not flagged if invert
+// is set) in the mask. Items with ids outside the mask are never counted.
+int countFlaggedScalar(const result_type *buf, int from, int to, const uint16_t *m, uint16_t stamp, int maxid, bool invert) {
+  int n = 0;
+  result_type r;
+  for (int i=from; i<to; ++i) {
+    r = buf[i] & cat_mask;
+    if (r < maxid && (maskValue(m, stamp, maxid, r) != 0) != invert) n++;
+  }
+  return n;
+}
+
+// mask values of the items buf[0] to buf[n-1] (0 for ids outside the mask)
+void gatherFlagsScalar(const result_type *buf, int n, const uint16_t *m, uint16_t stamp, int maxid, unsigned char *out) {
+  for (int i=0; i<n; ++i) out[i] = maskValue(m, stamp, maxid, buf[i] & cat_mask);
+}
+
+#if defined(__x86_64__)
+// ids of eight consecutive items
+__attribute__((target("avx2"))) inline __m256i loadIds8(const result_type *buf) {
+  const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)buf), low);
+  __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(buf+4)), low);
+  return _mm256_and_si256(_mm256_permute2x128_si256(a, b, 0x20), _mm256_set1_epi32(cat_mask));
+}
+
+// mask values of eight ids, fetched with a single gather (the mask needs one padding entry)
+__attribute__((target("avx2"))) inline __m256i gatherMask8(__m256i id, const uint16_t *m, uint16_t stamp, int maxid) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(maxid), id);
+  __m256i v = _mm256_mask_i32gather_epi32(zero, (const int*)m, id, valid, 2);
+
+  // entry is set in the current epoch (0 < entry^stamp < 256)
+  v = _mm256_xor_si256(_mm256_and_si256(v, _mm256_set1_epi32(0xFFFF)), _mm256_set1_epi32(stamp));
+  valid = _mm256_and_si256(valid, _mm256_cmpgt_epi32(_mm256_set1_epi32(256), v));
+  return _mm256_and_si256(v, valid);
+}
+
+__attribute__((target("avx2"))) int countFlaggedAVX2(const result_type *buf, int from, int to, const uint16_t *m, uint16_t stamp, int maxid, bool invert) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max = _mm256_set1_epi32(maxid);
+  int n = 0, i = from;
+  for (; i+8 <= to; i += 8) {
+    __m256i id = loadIds8(&(buf[i]));
+    __m256i flagged = _mm256_cmpgt_epi32(gatherMask8(id, m, stamp, maxid), zero);
+    if (invert) flagged = _mm256_andnot_si256(flagged, _mm256_cmpgt_epi32(max, id));
+    n += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(flagged)));
+  }
+  return n + countFlaggedScalar(buf, i, to, m, stamp, maxid, invert);
+}
+
+__attribute__((target("avx2"))) void gatherFlagsAVX2(const result_type *buf, int n, const uint16_t *m, uint16_t stamp, int maxid, unsigned char *out) {
+  int i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m256i v = gatherMask8(loadIds8(&(buf[i])), m, stamp, maxid);
+
+    // pack the eight values (all below 256) into bytes
+    v = _mm256_packus_epi32(v, v);
+    v = _mm256_packus_epi16(v, v);
+    uint32_t lo = _mm256_cvtsi256_si32(v), hi = _mm256_extract_epi32(v, 4);
+    memcpy(&(out[i]), &lo, 4);
+    memcpy(&(out[i+4]), &hi, 4);
+  }
+  gatherFlagsScalar(buf+i, n-i, m, stamp, maxid, out+i);
+}
+#endif
+
+int countFlagged(const result_type *buf, int from, int to, const uint16_t *m, uint16_t stamp, int maxid, bool invert) {
+#if defined(__x86_64__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2 && !scalarKernels) return countFlaggedAVX2(buf, from, to, m, stamp, maxid, invert);
+#endif
+  return countFlaggedScalar(buf, from, to, m, stamp, maxid, invert);
+}
+
+void gatherFlags(const result_type *buf, int n, const uint16_t *m, uint16_t stamp, int maxid, unsigned char *out) {
+#if defined(__x86_64__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2 && !scalarKernels) {
+    gatherFlagsAVX2(buf, n, m, stamp, maxid, out);
+    return;
+  }
+#endif
+  gatherFlagsScalar(buf, n, m, stamp, maxid, out);
+}
+
+//
+// intersection of two id sorted lists without duplicate ids. The positions of the
+// common ids are written to ix and iy (in increasing order), the number of common ids
+// is returned.
+//
+
+inline tree_type itemId(result_type r) { return r & cat_mask; }
+
+// merge both lists starting at positions i and j
+int intersectScalar(const result_type *x, int nx, const result_type *y, int ny, int *ix, int *iy, int i=0, int j=0, int n=0) {
+  while (i < nx && j < ny) {
+    if (itemId(x[i]) < itemId(y[j])) i++;
+    else if (itemId(y[j]) < itemId(x[i])) j++;
+    else {
+      ix[n] = i++;
+      iy[n++] = j++;
+    }
+  }
+  return n;
+}
+
+// look up every id of the much shorter list x with an exponential search in y
+int intersectGallop(const result_type *x, int nx, const result_type *y, int ny, int *ix, int *iy) {
+  int n = 0, j = 0;
+  for (int i=0; i<nx && j<ny; ++i) {
+    tree_type v = itemId(x[i]);
+
+    // y[lo] < v for all probed positions past j, y[hi] >= v (or hi == ny)
+    int lo = j, step = 1;
+    while (lo+step < ny && itemId(y[lo+step]) < v) {
+      lo += step;
+      step <<= 1;
+    }
+    int hi = lo+step < ny ? lo+step : ny;
+    while (lo < hi) {
+      int mid = (lo+hi) >> 1;
+      if (itemId(y[mid]) < v) lo = mid+1; else hi = mid;
+    }
+
+    j = lo;
+    if (j < ny && itemId(y[j]) == v) {
+      ix[n] = i;
+      iy[n++] = j++;
+    }
+  }
+  return n;
+}
+
+#if defined(__x86_64__)
+// ids of four consecutive items (SSE2 is part of the x86_64 baseline)
+inline __m128i loadIds4(const result_type *buf) {
+  __m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)buf));
+  __m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(buf+2)));
+  return _mm_and_si128(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0))), _mm_set1_epi32(cat_mask));
+}
+
+// compare blocks of four ids of x against all rotations of four ids of y
+int intersectSSE(const result_type *x, int nx, const result_type *y, int ny, int *ix, int *iy) {
+  int i = 0, j = 0, n = 0;
+  while (i+4 <= nx && j+4 <= ny) {
+    __m128i a = loadIds4(&(x[i])), b = loadIds4(&(y[j]));
+    int m[4], any = 0;
+    for (int r=0; r<4; ++r) {
+      m[r] = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+      any |= m[r];
+      b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0,3,2,1));
+    }
+
+    // lane k of x matched in rotation r is item (k+r)&3 of the y block
+    if (any)
+      for (int k=0; k<4; ++k)
+        if ((any >> k) & 1)
+          for (int r=0; r<4; ++r)
+            if ((m[r] >> k) & 1) {
+              ix[n] = i+k;
+              iy[n++] = j + ((k+r) & 3);
+              break;
+            }
+
+    tree_type a3 = itemId(x[i+3]), b3 = itemId(y[j+3]);
+    if (a3 <= b3) i += 4;
+    if (b3 <= a3) j += 4;
+  }
+  return intersectScalar(x, nx, y, ny, ix, iy, i, j, n);
+}
+
+// same with blocks of eight ids
+__attribute__((target("avx2"))) int intersectAVX2(const result_type *x, int nx, const result_type *y, int ny, int *ix, int *iy) {
+  const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  int i = 0, j = 0, n = 0;
+  while (i+8 <= nx && j+8 <= ny) {
+    __m256i a = loadIds8(&(x[i])), b = loadIds8(&(y[j]));
+    int m[8], any = 0;
+    for (int r=0; r<8; ++r) {
+      m[r] = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+      any |= m[r];
+      b = _mm256_permutevar8x32_epi32(b, rotate);
+    }
+
+    // lane k of x matched in rotation r is item (k+r)&7 of the y block
+    if (any)
+      for (int k=0; k<8; ++k)
+        if ((any >> k) & 1)
+          for (int r=0; r<8; ++r)
+            if ((m[r] >> k) & 1) {
+              ix[n] = i+k;
+              iy[n++] = j + ((k+r) & 7);
+              break;
+            }
+
+    tree_type a7 = itemId(x[i+7]), b7 = itemId(y[j+7]);
+    if (a7 <= b7) i += 8;
+    if (b7 <= a7) j += 8;
+  }
+  return intersectScalar(x, nx, y, ny, ix, iy, i, j, n);
+}
+#endif
+
+// lists of very different sizes are galloped, otherwise the block kernels are used
+const int gallopRatio = 32;
+
+int intersectSorted(const result_type *x, int nx, const result_type *y, int ny, int *ix, int *iy) {
+  if (long(nx) * gallopRatio < ny) return intersectGallop(x, nx, y, ny, ix, iy);
+  if (long(ny) * gallopRatio < nx) return intersectGallop(y, ny, x, nx, iy, ix);
+#if defined(__x86_64__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (scalarKernels) return intersectScalar(x, nx, y, ny, ix, iy);
+  if (avx2) return intersectAVX2(x, nx, y, ny, ix, iy);
+  return intersectSSE(x, nx, y, ny, ix, iy);
+#else
+  return intersectScalar(x, nx, y, ny, ix, iy);
+#endif
+}
@@ -8,9 +8,13 @@
 #include "fastcci.h"
 
 // the graph
-int *cat;
+offset_type *cat;
 tree_type *tree;
 
+// subcategory index
+offset_type *scat;
+tree_type *stree;
+
 // depth buffer
 const int maxdepth = 30;
 int *cbuf[maxdepth+1];
@@ -25,10 +29,9 @@ inline void count(int v, int d) {
   cbuf[d][v] = 0;
 
   // Iterate over subcategories
-  int c = cat[v], cend = tree[c];
-  c += 2;
+  offset_type c = scat[v], cend = scat[v+1];
   while (c < cend) {
-    int w = tree[c];
+    int w = stree[c];
     cbuf[d][v] += cbuf[d-1][w];
     c++;
   }
@@ -45,10 +48,9 @@ inline int rcount(int v, int d) {
 
   // Iterate over subcategories
   int count = 0;
-  int c = cat[v], cend = tree[c];
-  c += 2;
+  offset_type c = scat[v], cend = scat[v+1];
   while (c < cend) {
-    int w = tree[c];
+    int w = stree[c];
     if (mask[w]==0)
       count += rcount(w, d-1);
     c++;
@@ -56,8 +58,9 @@ inline int rcount(int v, int d) {
 }
 
 int main() {
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
+  readSubcats("..", cat, maxcat, tree, scat, stree);
 
   mask = (char*)malloc(maxcat);
   memset(mask, 0, maxcat);
@@ -69,8 +72,6 @@ int main() {
     memset(cbuf[i], 0, maxcat * sizeof(int));
   }
 
-  readFile("../fastcci.tree", tree);
-
 #if 0
   // recursion
   for (int d=1; d<=maxdepth; ++d)
@@ -140,8 +141,6 @@ int main() {
       printf("%d %d\n", i, hist[i]);
   }
 
-  free(cat);
-  free(tree);
 
   free(cbuf);
 
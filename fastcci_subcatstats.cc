@@ -8,8 +8,10 @@
 #include "fastcci.h"
 
 // the graph
-int *cat; 
-tree_type *tree; 
+offset_type *cat;
+tree_type *tree;
+offset_type *scat;
+tree_type *stree;
 
 // depth buffer
 int *dbuf;
@@ -21,10 +23,9 @@ int depth(int v) {
   dbuf[v] = -2;
 
   // Iterate over subcategories
-  int c = cat[v], cend = tree[c];
-  c += 2;
+  offset_type c = scat[v], cend = scat[v+1];
   while (c < cend) {
-    w = tree[c];
+    w = stree[c];
 
     if (dbuf[w] >= 0)
     {
@@ -54,14 +55,13 @@ int depth(int v) {
 }
 
 int main() {
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
+  readSubcats("..", cat, maxcat, tree, scat, stree);
   
   dbuf      = (int*)malloc(maxcat * sizeof(*dbuf));
   memset(dbuf, 255, maxcat * sizeof(*dbuf));
 
-  readFile("../fastcci.tree", tree);
-
   // generate depth buffer
   for (int v=0; v<maxcat; ++v)
     if (cat[v]>-1 && dbuf[v]==-1) 
@@ -97,11 +97,10 @@ int main() {
         
         // Iterate over subcategories
         bool match = false;
-        int c = cat[w], cend = tree[c];
-        c += 2;
+        offset_type c = scat[w], cend = scat[w+1];
         while (c<cend) {
-          if (dbuf[tree[c]] == needdepth) {
-            w = tree[c];
+          if (dbuf[stree[c]] == needdepth) {
+            w = stree[c];
             printf("|%d", w);
             match = true;
             break;
@@ -113,8 +112,6 @@ int main() {
       printf("\n");
     }
 
-  free(cat);
-  free(tree);
 
   free(dbuf);
 
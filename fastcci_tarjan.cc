@@ -8,8 +8,10 @@
 #include "fastcci.h"
 
 // the graph
-int *cat; 
-tree_type *tree; 
+offset_type *cat;
+tree_type *tree;
+offset_type *scat;
+tree_type *stree;
 
 // Tarjan's id and lowlink fields
 int *id;
@@ -36,10 +38,9 @@ void strongconnect(int v) {
   Smask[v]++;
 
   // Consider successors of v
-  int c = cat[v], cend = tree[c];
-  c += 2;
+  offset_type c = scat[v], cend = scat[v+1];
   while (c<cend) {
-    w = tree[c];
+    w = stree[c];
     if (id[w] == 0) 
     {
       // Successor w has not yet been visited; recurse on it
@@ -80,8 +81,9 @@ void strongconnect(int v) {
 }
 
 int main() {
-  int maxcat = readFile("../fastcci.cat", cat);
-  maxcat /= sizeof(int);
+  bool packed;
+  int maxcat = readGraph("..", cat, tree, &packed);
+  readSubcats("..", cat, maxcat, tree, scat, stree);
   
   lowlink = (int*)malloc(maxcat * sizeof(*lowlink));
   id      = (int*)malloc(maxcat * sizeof(*id));
@@ -94,14 +96,10 @@ int main() {
   // scc result buffer
   scc = (int*)malloc(maxcat * sizeof(*scc));
 
-  readFile("../fastcci.tree", tree);
-
   for (int v=0; v<maxcat; ++v)
     if (cat[v]>-1 && id[v]==0) 
       strongconnect(v); 
 
-  free(cat);
-  free(tree);
 
   free(id);
   free(lowlink);
@@ -13,14 +13,18 @@ JS='curl -s -i -N http://localhost:'$PORT'/\?t=js\&'
 echo '== Building Database =='
 $FASTCCI_BIN/fastcci_build_db < test_dump.txt || exit 1
 [ $(md5sum 'done' | cut -c-8) = "d36f8f94" ] || exit 1
-[ $(md5sum 'fastcci.cat' | cut -c-8) = "6ef81ddf" ] || exit 1
-[ $(md5sum 'fastcci.tree' | cut -c-8) = "9c7acb41" ] || exit 1
+[ $(md5sum 'fastcci.cat' | cut -c-8) = "d8d0644e" ] || exit 1
+[ $(md5sum 'fastcci.tree' | cut -c-8) = "48e2db70" ] || exit 1
+[ $(md5sum 'fastcci.rcat' | cut -c-8) = "18950fbe" ] || exit 1
+[ $(md5sum 'fastcci.rtree' | cut -c-8) = "fb11ff85" ] || exit 1
+[ $(md5sum 'fastcci.scat' | cut -c-8) = "74a6cbcd" ] || exit 1
+[ $(md5sum 'fastcci.stree' | cut -c-8) = "3f8a2b1a" ] || exit 1
 echo 'passed.'
 echo
 
 # launch server (and wait for it to spin up)
 export LD_LIBRARY_PATH=$HOME/lib:$LD_LIBRARY_PATH
-$FASTCCI_BIN/fastcci_server $PORT . > /dev/null 2>&1 &
+$FASTCCI_BIN/fastcci_server -w 2 -r 1 $PORT . > /dev/null 2>&1 &
 until $(curl -s  http://localhost:$PORT/status > /dev/null); do sleep 1; done
 
 # test a few queries via websockets
@@ -46,6 +50,18 @@ echo
 # test a few HTTP queries
 echo '== Testing HTTP =='
 eval "$HTTP"'c1=1\&d1=15\&s=200\&a=fqv' | grep '^RESULT 5,0,1|4,0,1|7,1,3|8,1,4$' > /dev/null || exit 1
+eval "$HTTP"'c1=100\&c2=200\&a=not\&s=1\&exact=1' | grep '^OUTOF 2' > /dev/null || exit 1
+eval "$HTTP"'c1=100\&c2=200\&a=not\&o=1' | grep '^OUTOF 2$' > /dev/null || exit 1
+eval "$HTTP"'c1=100\&c2=200\&a=not\&o=1\&exact=1' | grep '^OUTOF 2$' > /dev/null || exit 1
+eval "$HTTP"'q=100%26200' | grep '^RESULT 101,0,0|104,2,0$' > /dev/null || exit 1
+eval "$HTTP"'q=%28100-200%29%7C%283:0%261:1%29' | grep '^RESULT 102,0,0|8,1,4|103,1,0$' > /dev/null || exit 1
+eval "$HTTP"'c1=104\&a=parents' | grep '^RESULT 120,0,0|220,0,0|100,1,0|200,1,0$' > /dev/null || exit 1
+eval "$HTTP"'c1=104\&d1=0\&a=parents' | grep '^OUTOF 2' > /dev/null || exit 1
+eval "$HTTP"'c1=1\&c2=6\&a=path' | grep '^RESULT 1,1,0|2,2,0|6,3,0$' > /dev/null || exit 1
+# binary result record (length 7, 'R', 2 items: zigzag page id deltas 102 and 1, depth << 3 | tag)
+curl -s 'http://localhost:'$PORT'/?c1=100&c2=200&a=not&t=bin' | head -c 12 | od -An -tx1 | tr -d ' \n' | grep '^070000005202cc0100020808$' > /dev/null || exit 1
+# bulk export of a complete result (sorted by page id)
+curl -s 'http://localhost:'$PORT'/export?c1=1&sort=1' | grep '^RESULT 4,0,1|5,0,1|7,1,3|8,1,4|9,2,0$' > /dev/null || exit 1
 echo 'passed.'
 echo
 
@@ -55,4 +71,280 @@ eval "$JS"'c1=1\&d1=15\&s=200\&a=fqv' | grep "fastcciCallback( \[ 'RESULT 5,0,1|
 echo 'passed.'
 echo
 
+# page through a result using a cursor
+echo '== Testing Cursor =='
+CURSOR=$(eval "$HTTP"'c1=100\&c2=200\&a=not\&s=1' | grep '^CURSOR ' | cut -c8- | tr -d '\r')
+[ -n "$CURSOR" ] || exit 1
+eval "$HTTP"'c1=100\&c2=200\&a=not\&s=1\&cursor='$CURSOR | grep '^RESULT 103,1,0$' > /dev/null || exit 1
+echo 'passed.'
+echo
+
+# repeated queries are served from the traversal cache
+echo '== Testing Status =='
+curl -s http://localhost:$PORT/status | grep '"cache":{"hits":[1-9]' > /dev/null || exit 1
+echo 'passed.'
+echo
+
+# apply an edge delta to the running server
+echo '== Testing Live Update =='
+printf '103 200 file +\n101 200 file -\n' > .fastcci.delta
+mv .fastcci.delta fastcci.delta
+while [ -e fastcci.delta ] || [ -e fastcci.delta.applying ]; do sleep 1; done
+eval "$HTTP"'c1=100\&c2=200' | grep '^RESULT 103,1,0|104,2,0$' > /dev/null || exit 1
+curl -s http://localhost:$PORT/status | grep '"overlay":{"edges":2,' > /dev/null || exit 1
+# a change past the reserved index is set aside, the rest of the batch is applied
+rm -rf delta && mkdir delta && cp fastcci.* done delta/
+$FASTCCI_BIN/fastcci_server -r 1 $((PORT+11)) delta > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+11))/status > /dev/null); do sleep 1; done
+printf '20000000 200 file +\n105 200 file +\n' > delta/.fastcci.delta
+mv delta/.fastcci.delta delta/fastcci.delta
+while [ -e delta/fastcci.delta ] || [ -e delta/fastcci.delta.applying ]; do sleep 1; done
+[ "$(cat delta/fastcci.delta.rejected)" = '20000000 200 file +' ] || exit 1
+curl -s 'http://localhost:'$((PORT+11))'/?c1=200&d1=0&a=list' | grep '105,0,0' > /dev/null || exit 1
+curl -s http://localhost:$((PORT+11))/status | grep '"rejected":1,"enabled":true}' > /dev/null || exit 1
+rm -rf delta
+# a locked database does not read live updates
+$FASTCCI_BIN/fastcci_server -l -r 1 $((PORT+12)) . > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+12))/status > /dev/null); do sleep 1; done
+curl -s http://localhost:$((PORT+12))/status | grep '"enabled":false}' > /dev/null || exit 1
+echo 'passed.'
+echo
+
+# build (from a binary edge stream) and serve a database with packed file lists (prefaulted, in huge pages)
+echo '== Testing Packed Database =='
+rm -rf packed && mkdir packed
+$FASTCCI_BIN/fastcci_edgestream < test_dump.txt 2> /dev/null > packed/dump.edges || exit 1
+(cd packed && ../$FASTCCI_BIN/fastcci_build_db -z < dump.edges > /dev/null) || exit 1
+[ $(md5sum 'packed/fastcci.tree' | cut -c-8) = "024e12c4" ] || exit 1
+[ $(md5sum 'packed/fastcci.rtree' | cut -c-8) = "fb11ff85" ] || exit 1
+$FASTCCI_BIN/fastcci_server -p -H thp -V $((PORT+1)) packed > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+1))/status > /dev/null); do sleep 1; done
+curl -s http://localhost:$((PORT+1))/status | grep '"warmup":[0-9]' > /dev/null || exit 1
+curl -s 'http://localhost:'$((PORT+1))'/?c1=1&d1=15&s=200&a=fqv' | grep '^RESULT 5,0,1|4,0,1|7,1,3|8,1,4$' > /dev/null || exit 1
+curl -s 'http://localhost:'$((PORT+1))'/?c1=100&c2=200&a=not' | grep '^RESULT 102,0,0|103,1,0$' > /dev/null || exit 1
+curl -s 'http://localhost:'$((PORT+1))'/?c1=104&a=parents' | grep '^RESULT 120,0,0|220,0,0|100,1,0|200,1,0$' > /dev/null || exit 1
+rm -rf packed
+echo 'passed.'
+echo
+
+# build and serve a database with dense ids (page ids are translated by the server)
+echo '== Testing Dense Ids =='
+rm -rf dense && mkdir dense
+(cd dense && ../$FASTCCI_BIN/fastcci_build_db -d < ../test_dump.txt > /dev/null) || exit 1
+[ $(md5sum 'dense/fastcci.cat' | cut -c-8) = "b7a19b07" ] || exit 1
+[ $(md5sum 'dense/fastcci.ids' | cut -c-8) = "be0452e1" ] || exit 1
+[ $(md5sum 'dense/fastcci.idorder' | cut -c-8) = "d36f773f" ] || exit 1
+$FASTCCI_BIN/fastcci_server $((PORT+2)) dense > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+2))/status > /dev/null); do sleep 1; done
+curl -s 'http://localhost:'$((PORT+2))'/?c1=1&d1=15&s=200&a=fqv' | grep '^RESULT 5,0,1|4,0,1|7,1,3|8,1,4$' > /dev/null || exit 1
+curl -s 'http://localhost:'$((PORT+2))'/?q=%28100-200%29%7C%283:0%261:1%29' | grep '^RESULT 102,0,0|8,1,4|103,1,0$' > /dev/null || exit 1
+curl -s 'http://localhost:'$((PORT+2))'/?c1=104&a=parents' | grep '^RESULT 120,0,0|220,0,0|100,1,0|200,1,0$' > /dev/null || exit 1
+rm -rf dense
+echo 'passed.'
+echo
+
+# a wider graph (levels of 100 and 300 categories, cycles, files in many categories, and
+# 255 separate categories of one file each). 1000 has a parent, so that the breadth first
+# layout starts from 3000 and differs from the page id order
+rm -rf wide && mkdir wide
+awk 'BEGIN {
+  for (i = 0; i < 100; i++) {
+    c = 1001 + i; print c, 1000, "s"
+    for (j = 0; j < 3; j++) print 2000 + 3*i + j, c, "s"
+    for (f = 0; f < 5; f++) print 100 + (i*7 + f*13) % 400, c, "f"
+  }
+  for (k = 0; k < 300; k++) {
+    for (f = 0; f < 4; f++) print 100 + (k*11 + f*17) % 600, 2000 + k, "f"
+    if (k % 5 == 0) print 1001 + k % 100, 2000 + k, "s"
+  }
+  for (i = 0; i < 100; i += 2) print 1001 + i, 3000, "s"
+  for (f = 0; f < 50; f++) print 100 + f*9, 3000, "f"
+  print 1000, 5000, "s"
+  for (k = 0; k < 255; k++) print 700 + k, 4000 + k, "f"
+}' | sort -u -k2,2n -k1,1n > wide/dump.txt
+(cd wide && ../$FASTCCI_BIN/fastcci_build_db < dump.txt > /dev/null) || exit 1
+
+# the database does not depend on the number of parser threads
+echo '== Testing Parallel Build =='
+rm -rf jobs && mkdir -p jobs/1 jobs/4 jobs/edges jobs/test
+(cd jobs/1 && ../../$FASTCCI_BIN/fastcci_build_db -j 1 < ../../wide/dump.txt > /dev/null) || exit 1
+(cd jobs/4 && ../../$FASTCCI_BIN/fastcci_build_db -j 4 < ../../wide/dump.txt > /dev/null) || exit 1
+$FASTCCI_BIN/fastcci_edgestream < wide/dump.txt 2> /dev/null > jobs/wide.edges || exit 1
+(cd jobs/edges && ../../$FASTCCI_BIN/fastcci_build_db -j 4 < ../wide.edges > /dev/null) || exit 1
+(cd jobs/test && ../../$FASTCCI_BIN/fastcci_build_db -j 3 < ../../test_dump.txt > /dev/null) || exit 1
+for f in done fastcci.cat fastcci.tree fastcci.rcat fastcci.rtree fastcci.scat fastcci.stree; do
+  cmp -s wide/$f jobs/1/$f && cmp -s wide/$f jobs/4/$f && cmp -s wide/$f jobs/edges/$f && cmp -s $f jobs/test/$f || exit 1
+done
+rm -rf jobs
+echo 'passed.'
+echo
+
+# unsorted input is sorted externally (in several runs with a 1MB buffer) into the same database
+echo '== Testing Unsorted Build =='
+rm -rf unsorted && mkdir -p unsorted/sorted unsorted/m1 unsorted/m64
+awk 'BEGIN {
+  for (c = 0; c < 1000; c++) {
+    if (c >= 10) print 100000 + c, 100000 + int(c/10), "s"
+    for (f = 0; f < 300; f++) print (c*7919 + f*104729) % 100000, 100000 + c, "f"
+  }
+}' > unsorted/dump.txt
+sort -k2,2n -k1,1n unsorted/dump.txt > unsorted/sorted/dump.txt
+sort -k1,1n unsorted/dump.txt > unsorted/m1/dump.txt
+(cd unsorted/sorted && ../../$FASTCCI_BIN/fastcci_build_db -j 1 < dump.txt > /dev/null) || exit 1
+(cd unsorted/m1 && ../../$FASTCCI_BIN/fastcci_build_db -u -m 1 < dump.txt | grep 'merging [2-9] sorted runs' > /dev/null) || exit 1
+(cd unsorted/m64 && ../../$FASTCCI_BIN/fastcci_build_db -u -m 64 < ../m1/dump.txt > /dev/null) || exit 1
+for f in done fastcci.cat fastcci.tree fastcci.rcat fastcci.rtree fastcci.scat fastcci.stree; do
+  cmp -s unsorted/sorted/$f unsorted/m1/$f && cmp -s unsorted/sorted/$f unsorted/m64/$f || exit 1
+done
+rm -rf unsorted
+echo 'passed.'
+echo
+
+# sorted items (and OUTOF) of a query, and a check that two queries return the same non-empty result
+items() {
+  curl -s "$1" | grep -a '^RESULT \|^OUTOF ' | sed 's/^RESULT //' | tr '|' '\n' | sort
+}
+same() {
+  local R=$(items "$1")
+  echo "$R" | grep ',' > /dev/null && [ "$R" = "$(items "$2")" ]
+}
+WIDE='http://localhost:'$((PORT+3))'/?'
+
+# large levels are expanded by the traversal team, results match a serial traversal
+echo '== Testing Parallel Traversal =='
+$FASTCCI_BIN/fastcci_server -w 1 -c 0 $((PORT+3)) wide > /dev/null 2>&1 &
+$FASTCCI_BIN/fastcci_server -t 4 -c 0 $((PORT+4)) wide > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+3))/status > /dev/null); do sleep 1; done
+until $(curl -s  http://localhost:$((PORT+4))/status > /dev/null); do sleep 1; done
+for Q in 'c1=1000&d1=-1&a=list&s=10000' 'c1=1000&d1=1&a=list&s=10000' 'c1=1000&c2=3000&d1=-1&d2=-1&s=10000' 'c1=1000&c2=3000&a=not&d2=0&s=10000'; do
+  same "$WIDE$Q" 'http://localhost:'$((PORT+4))'/?'"$Q" || exit 1
+done
+echo 'passed.'
+echo
+
+# the visitation masks are zeroed once every 255 epochs. Every query of the second pass
+# reuses the epoch of the same query in the first pass, with its stale entries untouched.
+echo '== Testing Mask Epochs =='
+for j in 1 2; do
+  for k in $(seq 0 254); do
+    curl -s "$WIDE"'c1='$((4000 + k))'&a=list' | grep '^RESULT '$((700 + k))',0,0$' > /dev/null || exit 1
+  done
+done
+same "$WIDE"'c1=1000&c2=3000&d1=-1&d2=-1&s=10000' 'http://localhost:'$((PORT+4))'/?c1=1000&c2=3000&d1=-1&d2=-1&s=10000' || exit 1
+echo 'passed.'
+echo
+
+# and/not queries stream c1 level by level and stop once the page is full, paging through
+# a streamed result returns the complete result
+echo '== Testing Streaming =='
+for A in and not; do
+  Q='c1=1000&c2=3000&a='$A'&d1=-1&d2=-1'
+  ALL=$(items "$WIDE$Q"'&s=10000&exact=1' | grep -v '^OUTOF')
+  [ "$ALL" = "$(for O in $(seq 0 100 500); do items "$WIDE$Q"'&s=100&o='$O; done | grep -v '^OUTOF' | sort)" ] || exit 1
+  same "$WIDE$Q"'&s=10000' "$WIDE$Q"'&s=10000&exact=1' || exit 1
+done
+curl -s http://localhost:$((PORT+3))/status | grep '"stream":[1-9]' > /dev/null || exit 1
+echo 'passed.'
+echo
+
+# every query plan returns the result of expanding both closures
+echo '== Testing Query Plans =='
+$FASTCCI_BIN/fastcci_server -c 16 $((PORT+5)) wide > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+5))/status > /dev/null); do sleep 1; done
+CACHED='http://localhost:'$((PORT+5))'/?'
+curl -s "$CACHED"'c1=1000&d1=-1&a=list' > /dev/null
+# probe (c1 cached, small c2)
+for A in and not; do
+  same "$CACHED"'c1=1000&c2=2001&a='$A'&d1=-1&d2=-1&s=10000' "$WIDE"'c1=1000&c2=2001&a='$A'&d1=-1&d2=-1&s=10000&exact=1' || exit 1
+done
+curl -s http://localhost:$((PORT+5))/status | grep '"probe":[1-9]' > /dev/null || exit 1
+# upward (small c1) against both (both cached)
+curl -s "$CACHED"'c1=2001&d1=-1&a=list' > /dev/null
+same "$WIDE"'c1=2001&c2=1000&d1=-1&d2=-1&s=10000' "$CACHED"'c1=2001&c2=1000&d1=-1&d2=-1&s=10000' || exit 1
+curl -s http://localhost:$((PORT+3))/status | grep '"upward":[1-9]' > /dev/null || exit 1
+echo 'passed.'
+echo
+
+# a cached c2 is probed in its bitmaps (and exact counts of two cached closures intersect
+# them), the results match the mask based evaluation of an uncached server
+echo '== Testing Cached Bitmaps =='
+curl -s "$CACHED"'c1=3000&d1=-1&a=list' > /dev/null
+for A in and not; do
+  for P in 's=10000' 's=10000&exact=1' 's=20&o=10&exact=1'; do
+    same "$CACHED"'c1=1000&c2=3000&a='$A'&d1=-1&d2=-1&'$P "$WIDE"'c1=1000&c2=3000&a='$A'&d1=-1&d2=-1&'$P || exit 1
+  done
+done
+# closures dense enough for bitset containers (files at depths 1 and 2 below 200000)
+rm -rf dense && mkdir dense
+awk 'BEGIN {
+  for (k = 1; k <= 10; k++) {
+    print 200000 + k, 200000, "s"
+    for (f = 0; f < 3000; f++) print k*3000 + f, 200000 + k, "f"
+  }
+  print 200011, 200001, "s"
+  for (f = 40000; f < 50000; f++) print f, 200011, "f"
+  for (f = 0; f < 70000; f += 7) print f, 200020, "f"
+}' | sort -u -k2,2n -k1,1n > dense/dump.txt
+(cd dense && ../$FASTCCI_BIN/fastcci_build_db < dump.txt > /dev/null) || exit 1
+$FASTCCI_BIN/fastcci_server -c 16 $((PORT+13)) dense > /dev/null 2>&1 &
+$FASTCCI_BIN/fastcci_server -c 0 $((PORT+14)) dense > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+13))/status > /dev/null) && $(curl -s  http://localhost:$((PORT+14))/status > /dev/null); do sleep 1; done
+for C in 200000 200001 200020; do curl -s 'http://localhost:'$((PORT+13))'/?c1='$C'&d1=-1&a=list' > /dev/null; done
+for Q in 'c1=200001&c2=200000&a=and' 'c1=200020&c2=200000&a=and' 'c1=200020&c2=200001&a=not' 'c1=200020&c2=200000&a=not'; do
+  for P in 's=100000' 's=100000&exact=1' 's=50&o=500&exact=1'; do
+    same 'http://localhost:'$((PORT+13))'/?'"$Q"'&d1=-1&d2=-1&'$P 'http://localhost:'$((PORT+14))'/?'"$Q"'&d1=-1&d2=-1&'$P || exit 1
+  done
+done
+rm -rf dense
+echo 'passed.'
+echo
+
+# the vectorized set operation kernels match the scalar ones
+echo '== Testing Scalar Kernels =='
+$FASTCCI_BIN/fastcci_server -S -c 0 $((PORT+6)) wide > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+6))/status > /dev/null); do sleep 1; done
+for Q in 'c1=1000&c2=3000&a=and' 'c1=1000&c2=3000&a=not' 'c1=1000&c2=3000&a=not&exact=1' 'c1=1000&c2=3000&a=and&o=10&exact=1' 'q=1000%263000' 'q=1000-3000' 'q=%281000%263000%29%7C2001'; do
+  same "$WIDE$Q"'&d1=-1&d2=-1&s=10000' 'http://localhost:'$((PORT+6))'/?'"$Q"'&d1=-1&d2=-1&s=10000' || exit 1
+done
+echo 'passed.'
+echo
+
+# replace the database of a running server with a rebuilt one (the files are renamed into
+# place, so the server keeps its mappings of the old ones until it reloads)
+echo '== Testing Reload =='
+rm -rf reload && mkdir -p reload/next
+cp wide/fastcci.* reload/
+touch -d @0 reload/done
+$FASTCCI_BIN/fastcci_server -r 1 $((PORT+7)) reload > /dev/null 2>&1 &
+until $(curl -s  http://localhost:$((PORT+7))/status > /dev/null); do sleep 1; done
+RELOAD='http://localhost:'$((PORT+7))'/?'
+(echo '955 1000 f' && cat wide/dump.txt) | sort -u -k2,2n -k1,1n > reload/next/dump.txt
+(cd reload/next && ../../$FASTCCI_BIN/fastcci_build_db < dump.txt > /dev/null) || exit 1
+for f in cat tree rcat rtree scat stree; do mv reload/next/fastcci.$f reload/; done
+mv reload/next/done reload/
+until curl -s http://localhost:$((PORT+7))/status | grep '"generation":[1-9]' > /dev/null; do sleep 1; done
+items "$RELOAD"'c1=1000&d1=0&a=list&s=1000' | grep '^955,0,0$' > /dev/null || exit 1
+same "$RELOAD"'c1=3000&d1=-1&a=list&s=10000' "$WIDE"'c1=3000&d1=-1&a=list&s=10000' || exit 1
+rm -rf reload
+echo 'passed.'
+echo
+
+# the breadth first block layout (also packed and with dense ids) gives the same results
+echo '== Testing Block Layout =='
+N=8
+for L in '-o' '-o -z' '-o -d'; do
+  rm -rf layout && mkdir layout
+  (cd layout && ../$FASTCCI_BIN/fastcci_build_db $L < ../wide/dump.txt > /dev/null) || exit 1
+  $FASTCCI_BIN/fastcci_server -c 0 $((PORT+N)) layout > /dev/null 2>&1 &
+  until $(curl -s  http://localhost:$((PORT+N))/status > /dev/null); do sleep 1; done
+  for Q in 'c1=1000&d1=-1&a=list' 'c1=2001&d1=2&a=list' 'c1=3000&d1=-1&a=list' 'c1=1000&c2=3000&d1=-1&d2=-1' 'c1=1000&c2=3000&a=not&d1=-1&d2=-1'; do
+    same "$WIDE$Q"'&s=10000' 'http://localhost:'$((PORT+N))'/?'"$Q"'&s=10000' || exit 1
+  done
+  N=$((N+1))
+done
+rm -rf layout
+echo 'passed.'
+echo
+
+rm -rf wide
 killall fastcci_server